@@ -1,162 +1,2107 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
 
 /* Constants */
 #define PAGE_SIZE 4096
-#define MAX_PAGES 1024
+#define MAX_PAGES 1024           /* Pages per benchmark run */
 #define MAX_TYPES 8
 #define INVALID_SWAP_TYPE (~0UL)
 
+/* Compressed pool (zsmalloc-like) */
+#define ZS_MIN_ALLOC 32
+#define ZS_ALIGN 16
+#define ZS_NR_CLASSES ((PAGE_SIZE - ZS_MIN_ALLOC) / ZS_ALIGN + 1)
+#define ZS_MAX_ZSPAGE_PAGES 4
+#define ZS_OBJ_IDX_BITS 10
+#define ZS_DIR_SHIFT 10
+#define ZS_DIR_SIZE 1024
+
+/* Pages that compress worse than this are stored as-is */
+#define FS_MAX_COMPRESSED (PAGE_SIZE * 7 / 8)
+
+/* Content index used to share identical pages */
+#define FS_DEDUP_BITS 12
+#define FS_DEDUP_SIZE (1U << FS_DEDUP_BITS)
+#define FS_DEDUP_LOCKS 64
+
+/* Sparse page index: 64-way radix tree nodes */
+#define FS_TREE_SHIFT 6
+#define FS_TREE_SLOTS (1UL << FS_TREE_SHIFT)
+#define FS_TREE_MASK (FS_TREE_SLOTS - 1)
+
+/*
+ * Slots of a type are guarded by striped locks, one stripe per index
+ * leaf, so a swap cluster is covered by a single lock
+ */
+#define FS_SLOT_LOCKS 64
+#define CACHE_LINE_SIZE 64
+
+/* Writeback of cold pages to a backing file */
+#define FS_WB_BATCH 32
+#define FS_WB_THREADS 2
+
 /* Structure definitions */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+struct zspage;
+
+/* All zspages of one object size */
+struct size_class {
+    pthread_mutex_t lock;
+    unsigned int size;           /* Object size */
+    unsigned int pages_per_zspage;
+    unsigned int objs_per_zspage;
+    struct list_head partial;    /* Zspages with free objects */
+    unsigned long nr_zspages;
+    unsigned long objs_inuse;
+};
+
+/*
+ * A zspage is a group of up to ZS_MAX_ZSPAGE_PAGES separate pages that
+ * objects of one size class are packed into back to back, so an object
+ * may straddle two pages. The free list is kept out of line.
+ */
+struct zspage {
+    struct list_head list;       /* On class->partial when not full */
+    struct size_class *class;
+    unsigned long id;            /* Slot in the pool's zspage directory */
+    unsigned int inuse;          /* Objects allocated */
+    unsigned int free;           /* First free object index */
+    unsigned char *pages[ZS_MAX_ZSPAGE_PAGES];
+    unsigned short freelist[];   /* Next free index per object */
+};
+
+/*
+ * Handles encode a zspage id and an object index. The zspage directory is
+ * a two-level table whose chunks never move, so handles are resolved
+ * without taking any lock.
+ */
+struct zs_pool {
+    struct size_class classes[ZS_NR_CLASSES];
+    struct zspage **dir[ZS_DIR_SIZE];
+    unsigned long *free_ids;     /* Stack of released zspage ids */
+    unsigned long nr_free_ids;
+    unsigned long next_id;       /* Next never-used id, 0 is reserved */
+    atomic_ulong pages_allocated; /* Updated under lock, read without */
+    pthread_mutex_t lock;        /* Protects ids */
+};
+
+/* Page compressor, selectable per frontswap type */
+struct frontswap_compressor {
+    const char *name;
+    /* Returns compressed length, or 0 if it does not fit in dst_cap */
+    int (*compress)(const unsigned char *src, int src_len,
+                    unsigned char *dst, int dst_cap);
+    /* Returns decompressed length, or -1 on corrupt input */
+    int (*decompress)(const unsigned char *src, int src_len,
+                      unsigned char *dst, int dst_cap);
+};
+
+/*
+ * A stored page image, shared by every frontswap_page with the same
+ * contents in any type. Identical pages compress to identical bytes, so
+ * candidates with a matching hash are verified by comparing the stored
+ * objects.
+ */
+struct frontswap_entry {
+    struct frontswap_entry *next; /* Hash chain */
+    uint64_t hash;               /* Hash of the uncompressed page */
+    unsigned long handle;        /* Object in frontswap_zpool */
+    unsigned int length;         /* Stored bytes, PAGE_SIZE if raw */
+    unsigned int refcount;       /* Pages referencing this entry */
+    unsigned char comp;          /* Index into frontswap_compressors */
+};
+
+/* A lock on its own cache line, so neighbouring stripes do not bounce */
+struct frontswap_lock {
+    pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct frontswap_dedup {
+    struct frontswap_entry *buckets[FS_DEDUP_SIZE];
+    struct frontswap_lock locks[FS_DEDUP_LOCKS]; /* Striped by bucket */
+    atomic_ulong nr_entries;
+    atomic_ulong nr_refs;
+};
+
+/* Where a stored page's data lives */
+enum {
+    FS_PAGE_MEM,                 /* In the pool */
+    FS_PAGE_WRITEBACK,           /* In the pool, being written to the file */
+    FS_PAGE_DISK,                /* In the backing file only */
+};
+
+/*
+ * Fields are protected by the page's slot lock, except lru and on_lru
+ * which belong to lru_lock. id and gen are written holding both.
+ */
 struct frontswap_page {
-    unsigned char *data;
+    union {
+        struct frontswap_entry *entry; /* Shared page image */
+        unsigned long value;     /* Fill word if same_filled */
+    };
+    struct list_head lru;        /* On fs_type->lru while in the pool */
+    unsigned long id;            /* Page id, to find the slot lock */
+    unsigned long offset;        /* File offset once written back */
+    unsigned int length;         /* Bytes in the file */
+    unsigned int gen;            /* Bumped by every store to the slot */
+    unsigned char comp;          /* Compressor of the file copy */
+    unsigned char state;         /* FS_PAGE_* */
+    bool on_lru;
+    bool referenced;             /* Loaded since the last LRU scan */
+    bool same_filled;            /* Page is one repeated word */
     bool is_valid;
 };
 
-struct frontswap_type {
-    struct frontswap_page *pages;
-    unsigned long num_pages;
-    unsigned long stored_pages;
-    pthread_mutex_t lock;
-    bool is_active;
-};
+/* Backing file and worker threads that evict a type's coldest pages */
+struct frontswap_writeback {
+    int fd;
+    unsigned long limit;         /* In-memory byte budget for the type */
+    off_t tail;                  /* Next free file offset */
+    pthread_t threads[FS_WB_THREADS];
+    pthread_mutex_t lock;        /* Protects tail and the flags below */
+    pthread_cond_t wake;         /* Workers wait here for work */
+    pthread_cond_t done;         /* Signalled after each batch */
+    int busy;                    /* Workers inside a batch */
+    bool paused;
+    bool stalled;                /* Last batch found nothing to write */
+    bool stop;
+    atomic_ulong disk_pages;
+    atomic_ulong disk_bytes;
+    atomic_ulong dead_bytes;     /* Extents of pages invalidated on disk */
+    atomic_ulong batches;
+};
+
+/*
+ * Node of a type's page index. Interior nodes hold child pointers and
+ * leaves hold the pages themselves. Nodes are only ever added while the
+ * type is live: children are installed and the root is grown with a
+ * compare-and-swap, so lookups walk the tree without taking a lock and
+ * memory follows the set of ids in use rather than the area size.
+ * Each node is allocated only as large as its own array, so interior
+ * nodes do not pay for the leaf's page slots.
+ */
+struct frontswap_node {
+    unsigned int shift;          /* Id bits below this level, 0 in leaves */
+    union {
+        struct frontswap_node *_Atomic slots[FS_TREE_SLOTS];
+        struct frontswap_page pages[FS_TREE_SLOTS];
+    };
+};
+
+struct frontswap_type {
+    struct frontswap_node *_Atomic root;
+    atomic_ulong nr_nodes;
+    atomic_ulong node_bytes;
+    unsigned long num_pages;     /* Valid ids are 0 .. num_pages - 1 */
+    atomic_ulong stored_pages;
+    atomic_ulong stored_bytes;   /* Bytes held in the compressed pool */
+    atomic_ulong same_filled_pages; /* Stored pages kept as a fill word */
+    const struct frontswap_compressor *_Atomic comp;
+    struct frontswap_lock locks[FS_SLOT_LOCKS]; /* Leaf i uses i % FS_SLOT_LOCKS */
+    struct list_head lru;        /* In-pool pages, hottest first */
+    pthread_mutex_t lru_lock;    /* Nests inside the slot locks */
+    struct frontswap_writeback *wb; /* NULL unless writeback is enabled */
+    bool is_active;
+};
+
+/* Cap on pool memory shared by all types */
+struct frontswap_limit {
+    unsigned long max_bytes;     /* 0 for no limit */
+    unsigned int accept_percent; /* Accept again below this share of max */
+    atomic_bool full;
+    atomic_bool shrink_pending;  /* A store asked the workers to shrink */
+    atomic_uint shrinkers;       /* Workers running a pool shrink */
+    atomic_ulong rejected;
+    atomic_ulong shrunk_bytes;
+};
+
+/* Global variables */
+static struct frontswap_type *frontswap_types[MAX_TYPES];
+static unsigned long frontswap_enabled_types;
+static struct zs_pool *frontswap_zpool;
+static struct frontswap_dedup frontswap_dedup;
+static struct frontswap_limit frontswap_limit = {
+    .accept_percent = 90,
+};
+
+/* Helper functions */
+static void *zalloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new,
+                            struct list_head *prev,
+                            struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline bool list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/*
+ * LZ4 block format compressor. Greedy single-probe hash matching over a
+ * 4 KB page; offsets fit in 16 bits because inputs never exceed 64 KB.
+ */
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Write a length continuation (runs of 255), false if out of space */
+static bool lz4_put_length(unsigned char **op, unsigned char *oend, int len)
+{
+    while (len >= 255) {
+        if (*op >= oend)
+            return false;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend)
+        return false;
+    *(*op)++ = len;
+    return true;
+}
+
+/* Emit one sequence: literals followed by an optional match */
+static bool lz4_put_sequence(unsigned char **op, unsigned char *oend,
+                             const unsigned char *lit, int lit_len,
+                             int offset, int match_len)
+{
+    unsigned char *token;
+    int ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+
+    if (*op >= oend)
+        return false;
+    token = (*op)++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+
+    if (lit_len >= 15 && !lz4_put_length(op, oend, lit_len - 15))
+        return false;
+    if (oend - *op < lit_len)
+        return false;
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+
+    if (!match_len)
+        return true;
+
+    if (oend - *op < 2)
+        return false;
+    *(*op)++ = offset & 0xFF;
+    *(*op)++ = offset >> 8;
+    if (ml >= 15 && !lz4_put_length(op, oend, ml - 15))
+        return false;
+    return true;
+}
+
+static int lz4_compress(const unsigned char *src, int src_len,
+                        unsigned char *dst, int dst_cap)
+{
+    uint16_t table[1 << LZ4_HASH_BITS];
+    unsigned char *op = dst, *oend = dst + dst_cap;
+    int ip = 0, anchor = 0, ref, len, step;
+    uint32_t seq, h;
+
+    if (src_len > 65535)
+        return 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip < src_len - LZ4_MFLIMIT) {
+        seq = lz4_read32(src + ip);
+        h = lz4_hash(seq);
+        ref = table[h];
+        table[h] = ip;
+
+        if (ref >= ip || lz4_read32(src + ref) != seq) {
+            /* Skip faster through incompressible data */
+            step = 1 + ((ip - anchor) >> 6);
+            ip += step;
+            continue;
+        }
+
+        len = LZ4_MIN_MATCH;
+        while (ip + len < src_len - LZ4_LAST_LITERALS &&
+               src[ref + len] == src[ip + len])
+            len++;
+
+        if (!lz4_put_sequence(&op, oend, src + anchor, ip - anchor,
+                              ip - ref, len))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!lz4_put_sequence(&op, oend, src + anchor, src_len - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+/* Read a length continuation, -1 if it runs off the input */
+static int lz4_get_length(const unsigned char **ip, const unsigned char *iend)
+{
+    int len = 0;
+    unsigned char b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+static int lz4_decompress(const unsigned char *src, int src_len,
+                          unsigned char *dst, int dst_cap)
+{
+    const unsigned char *ip = src, *iend = src + src_len;
+    unsigned char *op = dst, *oend = dst + dst_cap;
+    const unsigned char *match;
+    int lit_len, match_len, offset, extra;
+    unsigned char token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit_len = token >> 4;
+        if (lit_len == 15) {
+            if ((extra = lz4_get_length(&ip, iend)) < 0)
+                return -1;
+            lit_len += extra;
+        }
+        if (iend - ip < lit_len || oend - op < lit_len)
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The last sequence carries literals only */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+
+        match_len = token & 15;
+        if (match_len == 15) {
+            if ((extra = lz4_get_length(&ip, iend)) < 0)
+                return -1;
+            match_len += extra;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (oend - op < match_len)
+            return -1;
+
+        /* Byte copy only when the match overlaps the output */
+        match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            while (match_len--)
+                *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+static const struct frontswap_compressor frontswap_compressors[] = {
+    { "none", NULL, NULL },
+    { "lz4", lz4_compress, lz4_decompress },
+};
+
+#define NR_COMPRESSORS \
+    (sizeof(frontswap_compressors) / sizeof(frontswap_compressors[0]))
+
+/* Compressed pool */
+static unsigned int zs_class_index(size_t size)
+{
+    if (size < ZS_MIN_ALLOC)
+        size = ZS_MIN_ALLOC;
+    return (size - ZS_MIN_ALLOC + ZS_ALIGN - 1) / ZS_ALIGN;
+}
+
+/* Pick the zspage length that wastes the least tail space */
+static unsigned int zs_pages_per_zspage(unsigned int size)
+{
+    unsigned int i, best = 1, best_waste = PAGE_SIZE;
+
+    for (i = 1; i <= ZS_MAX_ZSPAGE_PAGES; i++) {
+        unsigned int waste = (i * PAGE_SIZE) % size;
+
+        /* Compare waste as a fraction of the zspage */
+        if (waste * best < best_waste * i) {
+            best = i;
+            best_waste = waste;
+        }
+    }
+    return best;
+}
+
+static struct zs_pool *zs_create_pool(void)
+{
+    struct zs_pool *pool;
+    unsigned int i;
+
+    pool = zalloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    for (i = 0; i < ZS_NR_CLASSES; i++) {
+        struct size_class *class = &pool->classes[i];
+
+        class->size = ZS_MIN_ALLOC + i * ZS_ALIGN;
+        class->pages_per_zspage = zs_pages_per_zspage(class->size);
+        class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE / class->size;
+        INIT_LIST_HEAD(&class->partial);
+        pthread_mutex_init(&class->lock, NULL);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->next_id = 1;
+    return pool;
+}
+
+static inline struct zspage *zs_lookup(struct zs_pool *pool, unsigned long id)
+{
+    return pool->dir[id >> ZS_DIR_SHIFT][id & ((1UL << ZS_DIR_SHIFT) - 1)];
+}
+
+/* Reserve a directory slot for a zspage, 0 if the directory is full */
+static unsigned long zs_get_id(struct zs_pool *pool, struct zspage *zspage)
+{
+    unsigned long id, *ids;
+    struct zspage ***chunk;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nr_free_ids) {
+        id = pool->free_ids[--pool->nr_free_ids];
+    } else {
+        id = pool->next_id;
+        chunk = &pool->dir[id >> ZS_DIR_SHIFT];
+        if ((id >> ZS_DIR_SHIFT) >= ZS_DIR_SIZE ||
+            (!*chunk && !(*chunk = zalloc(sizeof(**chunk) << ZS_DIR_SHIFT)))) {
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        /* Grow the free-id stack so releasing this id never fails */
+        ids = realloc(pool->free_ids, (id + 1) * sizeof(*ids));
+        if (!ids) {
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        pool->free_ids = ids;
+        pool->next_id++;
+    }
+    pool->dir[id >> ZS_DIR_SHIFT][id & ((1UL << ZS_DIR_SHIFT) - 1)] = zspage;
+    atomic_fetch_add_explicit(&pool->pages_allocated,
+                              zspage->class->pages_per_zspage,
+                              memory_order_relaxed);
+    pthread_mutex_unlock(&pool->lock);
+    return id;
+}
+
+static void zs_put_id(struct zs_pool *pool, struct zspage *zspage)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->dir[zspage->id >> ZS_DIR_SHIFT]
+             [zspage->id & ((1UL << ZS_DIR_SHIFT) - 1)] = NULL;
+    pool->free_ids[pool->nr_free_ids++] = zspage->id;
+    atomic_fetch_sub_explicit(&pool->pages_allocated,
+                              zspage->class->pages_per_zspage,
+                              memory_order_relaxed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void zs_free_zspage(struct zspage *zspage)
+{
+    unsigned int i;
+
+    for (i = 0; i < zspage->class->pages_per_zspage; i++)
+        free(zspage->pages[i]);
+    free(zspage);
+}
+
+/* Allocate a zspage for class, called with class->lock held */
+static struct zspage *zs_alloc_zspage(struct zs_pool *pool,
+                                      struct size_class *class)
+{
+    struct zspage *zspage;
+    unsigned int i;
+
+    zspage = zalloc(sizeof(*zspage) +
+                    class->objs_per_zspage * sizeof(unsigned short));
+    if (!zspage)
+        return NULL;
+
+    zspage->class = class;
+    for (i = 0; i < class->pages_per_zspage; i++) {
+        zspage->pages[i] = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+        if (!zspage->pages[i]) {
+            zs_free_zspage(zspage);
+            return NULL;
+        }
+    }
+    for (i = 0; i < class->objs_per_zspage; i++)
+        zspage->freelist[i] = i + 1;
+
+    zspage->id = zs_get_id(pool, zspage);
+    if (!zspage->id) {
+        zs_free_zspage(zspage);
+        return NULL;
+    }
+
+    list_add(&zspage->list, &class->partial);
+    class->nr_zspages++;
+    return zspage;
+}
+
+/* Allocate size bytes; returns a handle, or 0 on failure */
+static unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+    struct size_class *class;
+    struct zspage *zspage;
+    unsigned int idx;
+
+    if (!size || size > PAGE_SIZE)
+        return 0;
+
+    class = &pool->classes[zs_class_index(size)];
+    pthread_mutex_lock(&class->lock);
+
+    if (list_empty(&class->partial) && !zs_alloc_zspage(pool, class)) {
+        pthread_mutex_unlock(&class->lock);
+        return 0;
+    }
+
+    zspage = list_entry(class->partial.next, struct zspage, list);
+    idx = zspage->free;
+    zspage->free = zspage->freelist[idx];
+    zspage->inuse++;
+    class->objs_inuse++;
+    if (zspage->inuse == class->objs_per_zspage)
+        list_del(&zspage->list);
+
+    pthread_mutex_unlock(&class->lock);
+    return zspage->id << ZS_OBJ_IDX_BITS | idx;
+}
+
+static void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+    struct zspage *zspage = zs_lookup(pool, handle >> ZS_OBJ_IDX_BITS);
+    unsigned int idx = handle & ((1U << ZS_OBJ_IDX_BITS) - 1);
+    struct size_class *class = zspage->class;
+
+    pthread_mutex_lock(&class->lock);
+
+    if (zspage->inuse == class->objs_per_zspage)
+        list_add(&zspage->list, &class->partial);
+    zspage->freelist[idx] = zspage->free;
+    zspage->free = idx;
+    zspage->inuse--;
+    class->objs_inuse--;
+
+    if (zspage->inuse == 0) {
+        list_del(&zspage->list);
+        class->nr_zspages--;
+        zs_put_id(pool, zspage);
+        zs_free_zspage(zspage);
+    }
+
+    pthread_mutex_unlock(&class->lock);
+}
+
+/* Locate byte offset off of an object within its zspage */
+static unsigned char *zs_obj_addr(struct zspage *zspage, unsigned int idx,
+                                  size_t *room)
+{
+    size_t off = (size_t)idx * zspage->class->size;
+
+    *room = PAGE_SIZE - off % PAGE_SIZE;
+    return zspage->pages[off / PAGE_SIZE] + off % PAGE_SIZE;
+}
+
+/*
+ * Return a contiguous view of an object. Objects that straddle two pages
+ * are copied into buf, which must hold the class size.
+ */
+static const unsigned char *zs_map_object(struct zs_pool *pool,
+                                          unsigned long handle,
+                                          unsigned char *buf, size_t len)
+{
+    struct zspage *zspage = zs_lookup(pool, handle >> ZS_OBJ_IDX_BITS);
+    unsigned int idx = handle & ((1U << ZS_OBJ_IDX_BITS) - 1);
+    unsigned char *addr;
+    size_t room;
+
+    addr = zs_obj_addr(zspage, idx, &room);
+    if (len <= room)
+        return addr;
+
+    memcpy(buf, addr, room);
+    addr = zspage->pages[((size_t)idx * zspage->class->size) / PAGE_SIZE + 1];
+    memcpy(buf + room, addr, len - room);
+    return buf;
+}
+
+/* Copy len bytes into an object, splitting at a page boundary if needed */
+static void zs_write_object(struct zs_pool *pool, unsigned long handle,
+                            const unsigned char *src, size_t len)
+{
+    struct zspage *zspage = zs_lookup(pool, handle >> ZS_OBJ_IDX_BITS);
+    unsigned int idx = handle & ((1U << ZS_OBJ_IDX_BITS) - 1);
+    unsigned char *addr;
+    size_t room;
+
+    addr = zs_obj_addr(zspage, idx, &room);
+    if (len <= room) {
+        memcpy(addr, src, len);
+        return;
+    }
+
+    memcpy(addr, src, room);
+    addr = zspage->pages[((size_t)idx * zspage->class->size) / PAGE_SIZE + 1];
+    memcpy(addr, src + room, len - room);
+}
+
+static void zs_destroy_pool(struct zs_pool *pool)
+{
+    unsigned long id;
+    struct zspage *zspage;
+
+    if (!pool)
+        return;
+
+    for (id = 1; id < pool->next_id; id++) {
+        zspage = zs_lookup(pool, id);
+        if (zspage)
+            zs_free_zspage(zspage);
+    }
+    for (id = 0; id < ZS_DIR_SIZE; id++)
+        free(pool->dir[id]);
+    for (id = 0; id < ZS_NR_CLASSES; id++)
+        pthread_mutex_destroy(&pool->classes[id].lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free_ids);
+    free(pool);
+}
+
+static unsigned long zs_get_total_pages(struct zs_pool *pool)
+{
+    return atomic_load_explicit(&pool->pages_allocated, memory_order_relaxed);
+}
+
+/* Initialize frontswap type */
+static int frontswap_init(unsigned type, unsigned long num_pages)
+{
+    struct frontswap_type *fs_type;
+    unsigned int i;
+
+    if (type >= MAX_TYPES || num_pages == 0)
+        return -1;
+
+    if (frontswap_types[type])
+        return -1;
+
+    fs_type = aligned_alloc(CACHE_LINE_SIZE, sizeof(*fs_type));
+    if (!fs_type)
+        return -1;
+    memset(fs_type, 0, sizeof(*fs_type));
+
+    atomic_init(&fs_type->root, NULL);
+    atomic_init(&fs_type->nr_nodes, 0);
+    atomic_init(&fs_type->node_bytes, 0);
+    fs_type->num_pages = num_pages;
+    atomic_init(&fs_type->stored_pages, 0);
+    atomic_init(&fs_type->stored_bytes, 0);
+    atomic_init(&fs_type->same_filled_pages, 0);
+    atomic_init(&fs_type->comp, &frontswap_compressors[1]);
+    fs_type->is_active = true;
+
+    if (!frontswap_zpool) {
+        frontswap_zpool = zs_create_pool();
+        if (!frontswap_zpool) {
+            free(fs_type);
+            return -1;
+        }
+        for (i = 0; i < FS_DEDUP_LOCKS; i++)
+            pthread_mutex_init(&frontswap_dedup.locks[i].lock, NULL);
+    }
+
+    for (i = 0; i < FS_SLOT_LOCKS; i++)
+        pthread_mutex_init(&fs_type->locks[i].lock, NULL);
+    INIT_LIST_HEAD(&fs_type->lru);
+    pthread_mutex_init(&fs_type->lru_lock, NULL);
+
+    frontswap_types[type] = fs_type;
+    frontswap_enabled_types++;
+
+    printf("Initialized frontswap type %u with %lu pages\n", type, num_pages);
+    return 0;
+}
+
+/* Select the compressor used for future stores into a type */
+static int frontswap_set_compressor(unsigned type, const char *name)
+{
+    struct frontswap_type *fs_type;
+    size_t i;
+
+    if (type >= MAX_TYPES || !(fs_type = frontswap_types[type]))
+        return -1;
+
+    for (i = 0; i < NR_COMPRESSORS; i++) {
+        if (strcmp(frontswap_compressors[i].name, name) == 0) {
+            atomic_store(&fs_type->comp, &frontswap_compressors[i]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Check whether a page is a single word repeated. The last word is tested
+ * first to reject most pages early; the scan then ORs eight XOR
+ * differences per 64-byte block, which the compiler turns into vector
+ * compares.
+ */
+static bool page_same_filled(const unsigned char *data, unsigned long *value)
+{
+    unsigned long val, last, block[8], diff;
+    unsigned int i, j;
+
+    memcpy(&val, data, sizeof(val));
+    memcpy(&last, data + PAGE_SIZE - sizeof(last), sizeof(last));
+    if (val != last)
+        return false;
+
+    for (i = 0; i < PAGE_SIZE; i += sizeof(block)) {
+        memcpy(block, data + i, sizeof(block));
+        diff = 0;
+        for (j = 0; j < 8; j++)
+            diff |= block[j] ^ val;
+        if (diff)
+            return false;
+    }
+
+    *value = val;
+    return true;
+}
+
+/* Rebuild a same-filled page */
+static void page_fill(unsigned char *data, unsigned long value)
+{
+    unsigned int i;
+
+    if (value == (value & 0xFF) * (~0UL / 0xFF)) {
+        memset(data, value & 0xFF, PAGE_SIZE);
+        return;
+    }
+    for (i = 0; i < PAGE_SIZE; i += sizeof(value))
+        memcpy(data + i, &value, sizeof(value));
+}
+
+static inline size_t frontswap_node_size(unsigned int shift)
+{
+    return offsetof(struct frontswap_node, slots) +
+           (shift ? sizeof(((struct frontswap_node *)0)->slots) :
+                    sizeof(((struct frontswap_node *)0)->pages));
+}
+
+static struct frontswap_node *frontswap_node_alloc(struct frontswap_type *fs_type,
+                                                  unsigned int shift)
+{
+    size_t size = frontswap_node_size(shift);
+    struct frontswap_node *node = zalloc(size);
+
+    if (node) {
+        node->shift = shift;
+        atomic_fetch_add_explicit(&fs_type->nr_nodes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&fs_type->node_bytes, size,
+                                  memory_order_relaxed);
+    }
+    return node;
+}
+
+static void frontswap_node_discard(struct frontswap_type *fs_type,
+                                   struct frontswap_node *node)
+{
+    atomic_fetch_sub_explicit(&fs_type->nr_nodes, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&fs_type->node_bytes,
+                              frontswap_node_size(node->shift),
+                              memory_order_relaxed);
+    free(node);
+}
+
+/*
+ * Find the page slot for page_id, optionally creating the path to it.
+ * Returns NULL if the slot does not exist (or cannot be allocated). A
+ * thread that loses a race to install a node frees its copy and follows
+ * the winner's; growing the root keeps the old root as child 0, so walks
+ * that started from it stay valid.
+ */
+static struct frontswap_page *frontswap_page_lookup(struct frontswap_type *fs_type,
+                                                    unsigned long page_id,
+                                                    bool create)
+{
+    struct frontswap_node *node, *child, *expected;
+    struct frontswap_node *_Atomic *slot;
+
+    node = atomic_load_explicit(&fs_type->root, memory_order_acquire);
+    if (!node) {
+        if (!create || !(child = frontswap_node_alloc(fs_type, 0)))
+            return NULL;
+        expected = NULL;
+        if (!atomic_compare_exchange_strong_explicit(&fs_type->root, &expected,
+                child, memory_order_acq_rel, memory_order_acquire))
+            frontswap_node_discard(fs_type, child);
+        node = atomic_load_explicit(&fs_type->root, memory_order_acquire);
+    }
+
+    /* Grow the tree until the root covers page_id */
+    while (node->shift + FS_TREE_SHIFT < 64 &&
+           page_id >> (node->shift + FS_TREE_SHIFT)) {
+        if (!create)
+            return NULL;
+        child = frontswap_node_alloc(fs_type, node->shift + FS_TREE_SHIFT);
+        if (!child)
+            return NULL;
+        atomic_init(&child->slots[0], node);
+        expected = node;
+        if (!atomic_compare_exchange_strong_explicit(&fs_type->root, &expected,
+                child, memory_order_acq_rel, memory_order_acquire))
+            frontswap_node_discard(fs_type, child);
+        node = atomic_load_explicit(&fs_type->root, memory_order_acquire);
+    }
+
+    while (node->shift) {
+        slot = &node->slots[(page_id >> node->shift) & FS_TREE_MASK];
+        child = atomic_load_explicit(slot, memory_order_acquire);
+        if (!child) {
+            if (!create)
+                return NULL;
+            child = frontswap_node_alloc(fs_type, node->shift - FS_TREE_SHIFT);
+            if (!child)
+                return NULL;
+            expected = NULL;
+            if (!atomic_compare_exchange_strong_explicit(slot, &expected, child,
+                    memory_order_acq_rel, memory_order_acquire)) {
+                frontswap_node_discard(fs_type, child);
+                child = expected;
+            }
+        }
+        node = child;
+    }
+    return &node->pages[page_id & FS_TREE_MASK];
+}
+
+static inline pthread_mutex_t *frontswap_slot_lock(struct frontswap_type *fs_type,
+                                                  unsigned long page_id)
+{
+    return &fs_type->locks[(page_id >> FS_TREE_SHIFT) & (FS_SLOT_LOCKS - 1)].lock;
+}
+
+/*
+ * Hash a page as four interleaved multiply-xor lanes so the multiplies
+ * of neighbouring words do not wait on each other.
+ */
+static uint64_t page_hash(const unsigned char *data)
+{
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t h[4] = { 1, 2, 3, 4 }, w[4];
+    unsigned int i, j;
+
+    for (i = 0; i < PAGE_SIZE; i += sizeof(w)) {
+        memcpy(w, data + i, sizeof(w));
+        for (j = 0; j < 4; j++) {
+            h[j] = (h[j] ^ w[j]) * prime;
+            h[j] ^= h[j] >> 29;
+        }
+    }
+    return (h[0] ^ (h[1] >> 1) ^ (h[2] << 1) ^ (h[3] >> 3)) * prime;
+}
+
+static inline pthread_mutex_t *frontswap_dedup_lock(uint64_t hash)
+{
+    return &frontswap_dedup.locks[hash & (FS_DEDUP_LOCKS - 1)].lock;
+}
+
+/*
+ * Find a stored image equal to src in a hash chain and take a reference
+ * on it, called with the chain's lock held.
+ */
+static struct frontswap_entry *frontswap_dedup_find(struct frontswap_entry *head,
+                                                    uint64_t hash,
+                                                    const unsigned char *src,
+                                                    unsigned int len,
+                                                    unsigned char comp)
+{
+    struct frontswap_entry *entry;
+    unsigned char buf[PAGE_SIZE];
+
+    for (entry = head; entry; entry = entry->next) {
+        if (entry->hash != hash || entry->length != len ||
+            entry->comp != comp)
+            continue;
+        if (memcmp(zs_map_object(frontswap_zpool, entry->handle, buf, len),
+                   src, len) == 0) {
+            entry->refcount++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take a reference on the entry holding a page image, creating it if no
+ * identical image is stored yet. On a miss the object is allocated and
+ * written with no lock held, and the chain is searched again before
+ * inserting in case another store raced us with the same page. Returns
+ * NULL if the pool is exhausted.
+ */
+static struct frontswap_entry *frontswap_entry_get(uint64_t hash,
+                                                   const unsigned char *src,
+                                                   unsigned int len,
+                                                   unsigned char comp)
+{
+    struct frontswap_dedup *dd = &frontswap_dedup;
+    struct frontswap_entry *entry, *new, **bucket;
+    pthread_mutex_t *lock = frontswap_dedup_lock(hash);
+
+    bucket = &dd->buckets[hash & (FS_DEDUP_SIZE - 1)];
+
+    pthread_mutex_lock(lock);
+    entry = frontswap_dedup_find(*bucket, hash, src, len, comp);
+    pthread_mutex_unlock(lock);
+    if (entry)
+        goto out;
+
+    new = malloc(sizeof(*new));
+    if (!new)
+        return NULL;
+    new->handle = zs_malloc(frontswap_zpool, len);
+    if (!new->handle) {
+        free(new);
+        return NULL;
+    }
+    zs_write_object(frontswap_zpool, new->handle, src, len);
+    new->hash = hash;
+    new->length = len;
+    new->comp = comp;
+    new->refcount = 1;
+
+    pthread_mutex_lock(lock);
+    entry = frontswap_dedup_find(*bucket, hash, src, len, comp);
+    if (!entry) {
+        new->next = *bucket;
+        *bucket = new;
+        entry = new;
+        new = NULL;
+    }
+    pthread_mutex_unlock(lock);
+
+    if (new) {
+        zs_free(frontswap_zpool, new->handle);
+        free(new);
+    } else {
+        atomic_fetch_add_explicit(&dd->nr_entries, 1, memory_order_relaxed);
+    }
+
+out:
+    atomic_fetch_add_explicit(&dd->nr_refs, 1, memory_order_relaxed);
+    return entry;
+}
+
+/* Drop a reference, freeing the pool object with the last one */
+static void frontswap_entry_put(struct frontswap_entry *entry)
+{
+    struct frontswap_dedup *dd = &frontswap_dedup;
+    pthread_mutex_t *lock = frontswap_dedup_lock(entry->hash);
+    struct frontswap_entry **pp;
+    bool last;
+
+    pthread_mutex_lock(lock);
+    last = --entry->refcount == 0;
+    if (last) {
+        pp = &dd->buckets[entry->hash & (FS_DEDUP_SIZE - 1)];
+        while (*pp != entry)
+            pp = &(*pp)->next;
+        *pp = entry->next;
+    }
+    pthread_mutex_unlock(lock);
+
+    atomic_fetch_sub_explicit(&dd->nr_refs, 1, memory_order_relaxed);
+    if (last) {
+        atomic_fetch_sub_explicit(&dd->nr_entries, 1, memory_order_relaxed);
+        zs_free(frontswap_zpool, entry->handle);
+        free(entry);
+    }
+}
+
+static inline bool frontswap_over_limit(struct frontswap_type *fs_type,
+                                        unsigned long slack)
+{
+    struct frontswap_writeback *wb = fs_type->wb;
+
+    return wb && wb->limit &&
+           atomic_load_explicit(&fs_type->stored_bytes, memory_order_relaxed) >
+           wb->limit + slack;
+}
+
+/* Put a page at the hot end of the LRU, called with its slot lock held */
+static void frontswap_lru_add(struct frontswap_type *fs_type,
+                              struct frontswap_page *page)
+{
+    pthread_mutex_lock(&fs_type->lru_lock);
+    list_add(&page->lru, &fs_type->lru);
+    page->on_lru = true;
+    pthread_mutex_unlock(&fs_type->lru_lock);
+}
+
+static void frontswap_lru_del(struct frontswap_type *fs_type,
+                              struct frontswap_page *page)
+{
+    pthread_mutex_lock(&fs_type->lru_lock);
+    if (page->on_lru) {
+        list_del(&page->lru);
+        page->on_lru = false;
+    }
+    pthread_mutex_unlock(&fs_type->lru_lock);
+}
+
+/* Write all of iov at off, resuming after short writes */
+static bool frontswap_pwritev_all(int fd, struct iovec *iov, int cnt, off_t off)
+{
+    ssize_t ret;
+
+    while (cnt) {
+        ret = pwritev(fd, iov, cnt, off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        off += ret;
+        while (cnt && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+/*
+ * Write back up to FS_WB_BATCH of the coldest in-memory pages with one
+ * pwritev at the tail of the backing file. Victims are taken off the LRU
+ * under lru_lock, then revalidated under their slot locks: pages that
+ * were invalidated or stored again in the meantime are skipped (a page
+ * stored again as same-filled holds a fill word, not an entry), and
+ * pages loaded since the last scan get a second chance at the hot end.
+ * A page stays readable from the pool while its write is in flight.
+ * Victims stop once they hold max_bytes of compressed data. Returns the
+ * number of pages written.
+ */
+static int frontswap_writeback_batch(struct frontswap_type *fs_type,
+                                     unsigned char *buf,
+                                     unsigned long max_bytes)
+{
+    struct frontswap_writeback *wb = fs_type->wb;
+    struct {
+        struct frontswap_page *page;
+        unsigned long id;
+        unsigned int gen;
+        unsigned int length;
+        unsigned char comp;
+    } batch[FS_WB_BATCH];
+    struct iovec iov[FS_WB_BATCH];
+    struct frontswap_entry *entry;
+    struct frontswap_page *page;
+    const unsigned char *src;
+    pthread_mutex_t *lock;
+    size_t total = 0, want = 0;
+    off_t off, pos;
+    int nr_cand = 0, nr = 0, i;
+    bool ok;
+
+    pthread_mutex_lock(&fs_type->lru_lock);
+    while (nr_cand < FS_WB_BATCH && want < max_bytes &&
+           !list_empty(&fs_type->lru)) {
+        page = list_entry(fs_type->lru.prev, struct frontswap_page, lru);
+        /* Pages leave the LRU before their entry is put */
+        want += page->entry->length;
+        list_del(&page->lru);
+        page->on_lru = false;
+        batch[nr_cand].page = page;
+        batch[nr_cand].id = page->id;
+        batch[nr_cand].gen = page->gen;
+        nr_cand++;
+    }
+    pthread_mutex_unlock(&fs_type->lru_lock);
+
+    for (i = 0; i < nr_cand; i++) {
+        page = batch[i].page;
+        lock = frontswap_slot_lock(fs_type, batch[i].id);
+
+        pthread_mutex_lock(lock);
+        if (!page->is_valid || page->same_filled ||
+            page->state != FS_PAGE_MEM || page->gen != batch[i].gen) {
+            pthread_mutex_unlock(lock);
+            continue;
+        }
+        if (page->referenced) {
+            page->referenced = false;
+            frontswap_lru_add(fs_type, page);
+            pthread_mutex_unlock(lock);
+            continue;
+        }
+
+        entry = page->entry;
+        page->state = FS_PAGE_WRITEBACK;
+        iov[nr].iov_base = buf + total;
+        iov[nr].iov_len = entry->length;
+        src = zs_map_object(frontswap_zpool, entry->handle, buf + total,
+                            entry->length);
+        if (src != buf + total)
+            memcpy(buf + total, src, entry->length);
+        total += entry->length;
+        batch[nr] = batch[i];
+        batch[nr].length = entry->length;
+        batch[nr].comp = entry->comp;
+        nr++;
+        pthread_mutex_unlock(lock);
+    }
+
+    if (!nr)
+        return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    off = wb->tail;
+    wb->tail += total;
+    pthread_mutex_unlock(&wb->lock);
+
+    ok = frontswap_pwritev_all(wb->fd, iov, nr, off);
+    if (!ok) {
+        /* Give the extent back if no later batch claimed past it */
+        pthread_mutex_lock(&wb->lock);
+        if (wb->tail == off + (off_t)total)
+            wb->tail = off;
+        else
+            atomic_fetch_add_explicit(&wb->dead_bytes, total,
+                                      memory_order_relaxed);
+        pthread_mutex_unlock(&wb->lock);
+    }
+
+    for (i = 0, pos = off; i < nr; pos += batch[i].length, i++) {
+        page = batch[i].page;
+        lock = frontswap_slot_lock(fs_type, batch[i].id);
+
+        pthread_mutex_lock(lock);
+        if (!page->is_valid || page->same_filled ||
+            page->state != FS_PAGE_WRITEBACK || page->gen != batch[i].gen) {
+            /* Invalidated while in flight; its extent is already dead */
+            if (ok)
+                atomic_fetch_add_explicit(&wb->dead_bytes, batch[i].length,
+                                          memory_order_relaxed);
+        } else if (!ok) {
+            page->state = FS_PAGE_MEM;
+            frontswap_lru_add(fs_type, page);
+        } else {
+            entry = page->entry;
+            page->offset = pos;
+            page->length = batch[i].length;
+            page->comp = batch[i].comp;
+            page->state = FS_PAGE_DISK;
+            atomic_fetch_sub_explicit(&fs_type->stored_bytes, page->length,
+                                      memory_order_relaxed);
+            atomic_fetch_add_explicit(&wb->disk_pages, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&wb->disk_bytes, page->length,
+                                      memory_order_relaxed);
+            frontswap_entry_put(entry);
+        }
+        pthread_mutex_unlock(lock);
+    }
+
+    if (!ok)
+        return 0;
+    atomic_fetch_add_explicit(&wb->batches, 1, memory_order_relaxed);
+    return nr;
+}
+
+static void frontswap_pool_shrink(void);
+
+/*
+ * Writeback worker: while the type is over its limit, evicts batches
+ * capped at the overshoot, so the pool settles near the limit rather
+ * than a full batch below it. Any type's worker may also pick up a
+ * shrink of the whole pool requested by a store that hit the limit.
+ */
+static void *frontswap_writeback_fn(void *arg)
+{
+    struct frontswap_type *fs_type = arg;
+    struct frontswap_writeback *wb = fs_type->wb;
+    unsigned long over;
+    unsigned char *buf;
+    int nr;
+
+    buf = malloc((size_t)FS_WB_BATCH * PAGE_SIZE);
+    if (!buf)
+        return NULL;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+        while (!wb->stop &&
+               (wb->paused || (!frontswap_over_limit(fs_type, 0) &&
+                               !atomic_load(&frontswap_limit.shrink_pending))))
+            pthread_cond_wait(&wb->wake, &wb->lock);
+        if (wb->stop)
+            break;
+        if (atomic_load(&frontswap_limit.shrink_pending)) {
+            pthread_mutex_unlock(&wb->lock);
+            frontswap_pool_shrink();
+            pthread_mutex_lock(&wb->lock);
+            continue;
+        }
+        over = atomic_load_explicit(&fs_type->stored_bytes, memory_order_relaxed);
+        if (over <= wb->limit)
+            continue;
+
+        wb->busy++;
+        pthread_mutex_unlock(&wb->lock);
+        nr = frontswap_writeback_batch(fs_type, buf, over - wb->limit);
+        pthread_mutex_lock(&wb->lock);
+        wb->busy--;
+
+        /* Nothing evictable: wait for the next store to kick us */
+        wb->stalled = nr == 0;
+        pthread_cond_broadcast(&wb->done);
+        if (wb->stalled && !wb->stop)
+            pthread_cond_wait(&wb->wake, &wb->lock);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Wake the writeback workers, then wait while the type is more than
+ * slack bytes over its limit and the workers are still making progress.
+ */
+static void frontswap_writeback_throttle(struct frontswap_type *fs_type,
+                                         unsigned long slack)
+{
+    struct frontswap_writeback *wb = fs_type->wb;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stalled = false;
+    pthread_cond_signal(&wb->wake);
+    while (!wb->stop && !wb->paused && !wb->stalled &&
+           frontswap_over_limit(fs_type, slack))
+        pthread_cond_wait(&wb->done, &wb->lock);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/* Wait until writeback has brought a type back under its limit */
+static void frontswap_writeback_sync(unsigned type)
+{
+    struct frontswap_type *fs_type;
+
+    if (type >= MAX_TYPES || !(fs_type = frontswap_types[type]) || !fs_type->wb)
+        return;
+    frontswap_writeback_throttle(fs_type, 0);
+}
+
+/* Stop the workers from starting new batches and wait out running ones */
+static void frontswap_writeback_pause(struct frontswap_writeback *wb)
+{
+    pthread_mutex_lock(&wb->lock);
+    wb->paused = true;
+    while (wb->busy)
+        pthread_cond_wait(&wb->done, &wb->lock);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+static void frontswap_writeback_resume(struct frontswap_writeback *wb)
+{
+    pthread_mutex_lock(&wb->lock);
+    wb->paused = false;
+    pthread_cond_broadcast(&wb->wake);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/*
+ * Keep a type's in-memory bytes within limit by writing its coldest
+ * pages to a backing file at path. The file is unlinked right away, so
+ * it disappears with the type. Space is appended to and never compacted;
+ * extents of invalidated pages are only counted as dead until the area
+ * is invalidated as a whole.
+ */
+static int frontswap_enable_writeback(unsigned type, const char *path,
+                                      unsigned long limit)
+{
+    struct frontswap_type *fs_type;
+    struct frontswap_writeback *wb;
+    int i;
+
+    if (type >= MAX_TYPES || !(fs_type = frontswap_types[type]) || fs_type->wb)
+        return -1;
+
+    wb = zalloc(sizeof(*wb));
+    if (!wb)
+        return -1;
+
+    wb->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (wb->fd < 0) {
+        free(wb);
+        return -1;
+    }
+    unlink(path);
+
+    wb->limit = limit;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->wake, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    fs_type->wb = wb;
+
+    for (i = 0; i < FS_WB_THREADS; i++)
+        pthread_create(&wb->threads[i], NULL, frontswap_writeback_fn, fs_type);
+    return 0;
+}
+
+static void frontswap_disable_writeback(struct frontswap_type *fs_type)
+{
+    struct frontswap_writeback *wb = fs_type->wb;
+    int i;
+
+    if (!wb)
+        return;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = true;
+    pthread_cond_broadcast(&wb->wake);
+    pthread_cond_broadcast(&wb->done);
+    pthread_mutex_unlock(&wb->lock);
+
+    for (i = 0; i < FS_WB_THREADS; i++)
+        pthread_join(wb->threads[i], NULL);
+
+    close(wb->fd);
+    pthread_cond_destroy(&wb->done);
+    pthread_cond_destroy(&wb->wake);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+    fs_type->wb = NULL;
+}
+
+/* Claim a writeback context for a batch, unless it is paused or stopping */
+static bool frontswap_writeback_begin(struct frontswap_writeback *wb)
+{
+    bool ok;
+
+    pthread_mutex_lock(&wb->lock);
+    ok = !wb->paused && !wb->stop;
+    if (ok)
+        wb->busy++;
+    pthread_mutex_unlock(&wb->lock);
+    return ok;
+}
+
+static void frontswap_writeback_end(struct frontswap_writeback *wb)
+{
+    pthread_mutex_lock(&wb->lock);
+    wb->busy--;
+    pthread_cond_broadcast(&wb->done);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/*
+ * Free at least bytes of pool memory by writing back pages. Each round
+ * takes one batch, capped at the bytes still needed, from the type with
+ * the most bytes in the pool, so the largest types shrink first and
+ * give up their coldest pages; types without writeback cannot be
+ * shrunk. Returns the pool bytes freed, which lags the bytes written
+ * when zspages stay partly used or entries are still shared.
+ */
+static unsigned long frontswap_shrink(unsigned long bytes)
+{
+    struct frontswap_type *fs_type, *best;
+    bool exhausted[MAX_TYPES] = { false };
+    unsigned long start, now, freed = 0, best_bytes, b;
+    unsigned char *buf;
+    unsigned int t, best_t = 0;
+    int nr;
+
+    if (!frontswap_zpool)
+        return 0;
+    buf = malloc((size_t)FS_WB_BATCH * PAGE_SIZE);
+    if (!buf)
+        return 0;
+
+    start = zs_get_total_pages(frontswap_zpool);
+    while (freed < bytes) {
+        best = NULL;
+        best_bytes = 0;
+        for (t = 0; t < MAX_TYPES; t++) {
+            fs_type = frontswap_types[t];
+            if (!fs_type || !fs_type->wb || exhausted[t])
+                continue;
+            b = atomic_load_explicit(&fs_type->stored_bytes,
+                                     memory_order_relaxed);
+            if (b > best_bytes) {
+                best = fs_type;
+                best_bytes = b;
+                best_t = t;
+            }
+        }
+        if (!best)
+            break;
+
+        nr = 0;
+        if (frontswap_writeback_begin(best->wb)) {
+            nr = frontswap_writeback_batch(best, buf, bytes - freed);
+            frontswap_writeback_end(best->wb);
+        }
+        if (!nr)
+            exhausted[best_t] = true;
+
+        now = zs_get_total_pages(frontswap_zpool);
+        freed = start > now ? (start - now) * PAGE_SIZE : 0;
+    }
+
+    free(buf);
+    atomic_fetch_add_explicit(&frontswap_limit.shrunk_bytes, freed,
+                              memory_order_relaxed);
+    return freed;
+}
+
+/*
+ * Shrink the pool below its accept threshold on behalf of a store that
+ * hit the limit. Called by writeback workers; only the one that claims
+ * the request does the work.
+ */
+static void frontswap_pool_shrink(void)
+{
+    struct frontswap_limit *lim = &frontswap_limit;
+    unsigned long total, accept;
+
+    /* Count ourselves before claiming so waiters never see neither */
+    atomic_fetch_add(&lim->shrinkers, 1);
+    if (atomic_exchange(&lim->shrink_pending, false) && lim->max_bytes) {
+        total = zs_get_total_pages(frontswap_zpool) * PAGE_SIZE;
+        accept = lim->max_bytes / 100 * lim->accept_percent;
+        if (total > accept)
+            frontswap_shrink(total - accept);
+    }
+    atomic_fetch_sub(&lim->shrinkers, 1);
+}
+
+/* Wake every type's writeback workers to pick up a pool shrink */
+static void frontswap_pool_shrink_kick(void)
+{
+    struct frontswap_writeback *wb;
+    unsigned int t;
+
+    for (t = 0; t < MAX_TYPES; t++) {
+        if (!frontswap_types[t] || !(wb = frontswap_types[t]->wb))
+            continue;
+        pthread_mutex_lock(&wb->lock);
+        pthread_cond_broadcast(&wb->wake);
+        pthread_mutex_unlock(&wb->lock);
+    }
+}
+
+/* Wait until no requested pool shrink is pending or running */
+static void frontswap_pool_shrink_wait(void)
+{
+    struct timespec ts = { 0, 1000000 }; /* 1ms */
+
+    while (atomic_load(&frontswap_limit.shrink_pending) ||
+           atomic_load(&frontswap_limit.shrinkers))
+        nanosleep(&ts, NULL);
+}
+
+/*
+ * Cap the memory held by the compressed pool across all types. Once the
+ * pool reaches max_bytes, stores are refused until it has drained below
+ * accept_percent of the limit. A max_bytes of 0 removes the cap.
+ */
+static int frontswap_set_pool_limit(unsigned long max_bytes,
+                                    unsigned int accept_percent)
+{
+    if (accept_percent > 100)
+        return -1;
+
+    frontswap_limit.max_bytes = max_bytes;
+    frontswap_limit.accept_percent = accept_percent;
+    atomic_store(&frontswap_limit.full, false);
+    return 0;
+}
+
+/* Cap the pool at a percentage of physical memory, like max_pool_percent */
+static int frontswap_set_max_pool_percent(unsigned int max_percent,
+                                          unsigned int accept_percent)
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+
+    if (pages <= 0 || max_percent > 100)
+        return -1;
+    return frontswap_set_pool_limit((unsigned long)pages / 100 * max_percent *
+                                    sysconf(_SC_PAGESIZE), accept_percent);
+}
+
+/*
+ * Decide whether a store may grow the pool. The store that finds the
+ * pool at its limit marks it full, is refused, and kicks the writeback
+ * workers to shrink the pool down to the accept threshold; the write
+ * I/O is not charged to the store. While full, stores are refused until
+ * the pool drops below the threshold, so the pool does not flap at the
+ * limit.
+ */
+static bool frontswap_pool_accept(void)
+{
+    struct frontswap_limit *lim = &frontswap_limit;
+    unsigned long total, accept;
+
+    if (!lim->max_bytes)
+        return true;
+
+    total = zs_get_total_pages(frontswap_zpool) * PAGE_SIZE;
+    accept = lim->max_bytes / 100 * lim->accept_percent;
+
+    if (total >= lim->max_bytes) {
+        atomic_store(&lim->full, true);
+        if (!atomic_exchange(&lim->shrink_pending, true))
+            frontswap_pool_shrink_kick();
+        goto reject;
+    }
+    if (atomic_load_explicit(&lim->full, memory_order_relaxed)) {
+        if (total > accept)
+            goto reject;
+        atomic_store(&lim->full, false);
+    }
+    return true;
+
+reject:
+    atomic_fetch_add_explicit(&lim->rejected, 1, memory_order_relaxed);
+    return false;
+}
 
-/* Global variables */
-static struct frontswap_type *frontswap_types[MAX_TYPES];
-static unsigned long frontswap_enabled_types;
+/* Print the global pool limit state */
+static void print_pool_limit_stats(void)
+{
+    struct frontswap_limit *lim = &frontswap_limit;
 
-/* Helper functions */
-static void *zalloc(size_t size)
+    printf("Pool: %lu KB of %lu KB limit (accept below %u%%), full: %s\n",
+           frontswap_zpool ? zs_get_total_pages(frontswap_zpool) * PAGE_SIZE >> 10 : 0,
+           lim->max_bytes >> 10, lim->accept_percent,
+           atomic_load(&lim->full) ? "yes" : "no");
+    printf("Rejected stores: %lu, shrunk: %lu KB\n", atomic_load(&lim->rejected),
+           atomic_load(&lim->shrunk_bytes) >> 10);
+}
+
+/* Release a stored page, called with the page's slot lock held */
+static void frontswap_free_page(struct frontswap_type *fs_type,
+                                struct frontswap_page *page)
 {
-    void *ptr = malloc(size);
-    if (ptr)
-        memset(ptr, 0, size);
-    return ptr;
+    struct frontswap_writeback *wb = fs_type->wb;
+
+    if (page->same_filled) {
+        atomic_fetch_sub_explicit(&fs_type->same_filled_pages, 1,
+                                  memory_order_relaxed);
+    } else if (page->state == FS_PAGE_DISK) {
+        atomic_fetch_sub_explicit(&wb->disk_pages, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&wb->disk_bytes, page->length,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&wb->dead_bytes, page->length,
+                                  memory_order_relaxed);
+    } else {
+        frontswap_lru_del(fs_type, page);
+        atomic_fetch_sub_explicit(&fs_type->stored_bytes, page->entry->length,
+                                  memory_order_relaxed);
+        frontswap_entry_put(page->entry);
+    }
+    atomic_fetch_sub_explicit(&fs_type->stored_pages, 1, memory_order_relaxed);
+    page->entry = NULL;
+    page->state = FS_PAGE_MEM;
+    page->same_filled = false;
+    page->is_valid = false;
 }
 
-/* Initialize frontswap type */
-static int frontswap_init(unsigned type, unsigned long num_pages)
+/* A page made ready for publishing by frontswap_prepare() */
+struct frontswap_prep {
+    struct frontswap_entry *entry;
+    unsigned long value;
+    unsigned int length;
+    bool same_filled;
+};
+
+/*
+ * Check for a same-filled page, or hash, compress and place the page in
+ * the pool. Runs without any lock held. Returns -1 if the pool is full
+ * or over its global limit; same-filled pages take no pool memory and
+ * are always accepted.
+ */
+static int frontswap_prepare(struct frontswap_type *fs_type,
+                             const unsigned char *data,
+                             struct frontswap_prep *prep)
 {
-    struct frontswap_type *fs_type;
+    const struct frontswap_compressor *compressor;
+    unsigned char buf[PAGE_SIZE];
+    const unsigned char *src = data;
+    unsigned char comp = 0;
+    int len = 0;
 
-    if (type >= MAX_TYPES || num_pages == 0 || num_pages > MAX_PAGES)
+    /* Same-filled pages keep only the fill word */
+    prep->entry = NULL;
+    prep->same_filled = page_same_filled(data, &prep->value);
+    if (prep->same_filled)
+        return 0;
+    if (!frontswap_pool_accept())
         return -1;
 
-    if (frontswap_types[type])
-        return -1;
+    /* Poorly compressible pages are kept raw and match any compressor */
+    compressor = atomic_load_explicit(&fs_type->comp, memory_order_relaxed);
+    if (compressor->compress)
+        len = compressor->compress(data, PAGE_SIZE, buf, FS_MAX_COMPRESSED);
+    if (len > 0) {
+        src = buf;
+        comp = compressor - frontswap_compressors;
+    } else {
+        len = PAGE_SIZE;
+    }
 
-    fs_type = zalloc(sizeof(*fs_type));
-    if (!fs_type)
-        return -1;
+    prep->length = len;
+    prep->entry = frontswap_entry_get(page_hash(data), src, len, comp);
+    return prep->entry ? 0 : -1;
+}
 
-    fs_type->pages = zalloc(num_pages * sizeof(struct frontswap_page));
-    if (!fs_type->pages) {
-        free(fs_type);
-        return -1;
+/*
+ * Install a prepared page in an empty slot, called with the slot lock
+ * and lru_lock held. id and gen are written under both so the LRU scan
+ * may read them under either.
+ */
+static void frontswap_publish(struct frontswap_type *fs_type,
+                              struct frontswap_page *page,
+                              unsigned long page_id,
+                              const struct frontswap_prep *prep)
+{
+    /* Every store is a new generation, same-filled ones included */
+    page->gen++;
+    page->same_filled = prep->same_filled;
+    page->is_valid = true;
+    if (prep->same_filled) {
+        page->value = prep->value;
+        return;
     }
 
-    fs_type->num_pages = num_pages;
-    fs_type->stored_pages = 0;
-    fs_type->is_active = true;
+    page->entry = prep->entry;
+    page->referenced = false;
+    page->id = page_id;
+    list_add(&page->lru, &fs_type->lru);
+    page->on_lru = true;
+}
 
-    if (pthread_mutex_init(&fs_type->lock, NULL) != 0) {
-        free(fs_type->pages);
-        free(fs_type);
-        return -1;
+/* Account for nr published pages holding bytes of pool data */
+static void frontswap_account_store(struct frontswap_type *fs_type,
+                                    unsigned long nr, unsigned long same,
+                                    unsigned long bytes)
+{
+    atomic_fetch_add_explicit(&fs_type->stored_pages, nr, memory_order_relaxed);
+    if (same)
+        atomic_fetch_add_explicit(&fs_type->same_filled_pages, same,
+                                  memory_order_relaxed);
+    if (bytes) {
+        atomic_fetch_add_explicit(&fs_type->stored_bytes, bytes,
+                                  memory_order_relaxed);
+        if (frontswap_over_limit(fs_type, 0))
+            frontswap_writeback_throttle(fs_type, fs_type->wb->limit / 8);
     }
+}
 
-    frontswap_types[type] = fs_type;
-    frontswap_enabled_types++;
+/* Look up a type for a request covering ids [page_id, page_id + nr) */
+static struct frontswap_type *frontswap_get_type(unsigned type,
+                                                 unsigned long page_id,
+                                                 unsigned long nr)
+{
+    struct frontswap_type *fs_type;
 
-    printf("Initialized frontswap type %u with %lu pages\n", type, num_pages);
-    return 0;
+    if (type >= MAX_TYPES || page_id == INVALID_SWAP_TYPE)
+        return NULL;
+
+    fs_type = frontswap_types[type];
+    if (!fs_type || !fs_type->is_active || page_id >= fs_type->num_pages ||
+        nr > fs_type->num_pages - page_id)
+        return NULL;
+    return fs_type;
 }
 
-/* Store a page in frontswap */
+/*
+ * Store a page in frontswap. Hashing, compression, pool allocation and
+ * the copy into the pool all run before the slot lock is taken; the lock
+ * only covers publishing the result, so stores and loads of different
+ * slots proceed in parallel. A type with writeback enabled never rejects
+ * a store for being over its limit; the store wakes the writeback
+ * workers instead, and waits for them once well past the limit.
+ */
 static int frontswap_store(unsigned type, unsigned long page_id, unsigned char *data)
 {
     struct frontswap_type *fs_type;
+    struct frontswap_page *page;
+    struct frontswap_prep prep;
+    pthread_mutex_t *lock;
     int ret = -1;
 
-    if (type >= MAX_TYPES || !data || page_id == INVALID_SWAP_TYPE)
+    fs_type = frontswap_get_type(type, page_id, 1);
+    if (!fs_type || !data)
         return -1;
 
-    fs_type = frontswap_types[type];
-    if (!fs_type || !fs_type->is_active)
+    page = frontswap_page_lookup(fs_type, page_id, true);
+    if (!page || frontswap_prepare(fs_type, data, &prep) != 0)
         return -1;
+    lock = frontswap_slot_lock(fs_type, page_id);
+
+    pthread_mutex_lock(lock);
+    if (!page->is_valid) {
+        pthread_mutex_lock(&fs_type->lru_lock);
+        frontswap_publish(fs_type, page, page_id, &prep);
+        pthread_mutex_unlock(&fs_type->lru_lock);
+        ret = 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    if (ret != 0) {
+        if (prep.entry)
+            frontswap_entry_put(prep.entry);
+        return ret;
+    }
+
+    frontswap_account_store(fs_type, 1, prep.same_filled,
+                            prep.same_filled ? 0 : prep.length);
+    return 0;
+}
+
+/*
+ * Store nr pages with consecutive ids, as swap-out does for a cluster.
+ * The batch is split at leaf boundaries; each piece is prepared without
+ * locks, then published with one tree lookup and one slot lock section.
+ * Returns the number of pages stored; slots that were already in use
+ * are left untouched.
+ */
+static int frontswap_store_batch(unsigned type, unsigned long page_id,
+                                 unsigned char **pages, unsigned int nr)
+{
+    struct frontswap_prep prep[FS_TREE_SLOTS];
+    struct frontswap_type *fs_type;
+    struct frontswap_page *leaf;
+    unsigned long id, same = 0, bytes = 0;
+    unsigned int done, n, i, ready;
+    pthread_mutex_t *lock;
+    int stored = 0;
+
+    fs_type = frontswap_get_type(type, page_id, nr);
+    if (!fs_type || !pages)
+        return 0;
+
+    for (done = 0; done < nr; done += n) {
+        id = page_id + done;
+        n = FS_TREE_SLOTS - (id & FS_TREE_MASK);
+        if (n > nr - done)
+            n = nr - done;
 
-    pthread_mutex_lock(&fs_type->lock);
+        leaf = frontswap_page_lookup(fs_type, id, true);
+        if (!leaf)
+            break;
 
-    if (page_id < fs_type->num_pages && !fs_type->pages[page_id].is_valid) {
-        fs_type->pages[page_id].data = malloc(PAGE_SIZE);
-        if (fs_type->pages[page_id].data) {
-            memcpy(fs_type->pages[page_id].data, data, PAGE_SIZE);
-            fs_type->pages[page_id].is_valid = true;
-            fs_type->stored_pages++;
-            ret = 0;
+        for (ready = 0; ready < n; ready++) {
+            if (frontswap_prepare(fs_type, pages[done + ready],
+                                  &prep[ready]) != 0)
+                break;
         }
+
+        lock = frontswap_slot_lock(fs_type, id);
+        pthread_mutex_lock(lock);
+        pthread_mutex_lock(&fs_type->lru_lock);
+        for (i = 0; i < ready; i++) {
+            if (leaf[i].is_valid)
+                continue;
+            frontswap_publish(fs_type, &leaf[i], id + i, &prep[i]);
+            if (prep[i].same_filled)
+                same++;
+            else
+                bytes += prep[i].length;
+            prep[i].entry = NULL;
+            stored++;
+        }
+        pthread_mutex_unlock(&fs_type->lru_lock);
+        pthread_mutex_unlock(lock);
+
+        for (i = 0; i < ready; i++) {
+            if (prep[i].entry)
+                frontswap_entry_put(prep[i].entry);
+        }
+        if (ready < n)
+            break;
     }
 
-    pthread_mutex_unlock(&fs_type->lock);
-    return ret;
+    if (stored)
+        frontswap_account_store(fs_type, stored, same, bytes);
+    return stored;
+}
+
+/* Read a written-back page from the backing file */
+static int frontswap_read_disk(struct frontswap_type *fs_type,
+                               struct frontswap_page *page, unsigned char *data)
+{
+    unsigned char buf[PAGE_SIZE];
+    unsigned char *dst = page->length == PAGE_SIZE ? data : buf;
+
+    if (pread(fs_type->wb->fd, dst, page->length, page->offset) !=
+        (ssize_t)page->length)
+        return -1;
+    if (page->length == PAGE_SIZE)
+        return 0;
+    return frontswap_compressors[page->comp].decompress(buf, page->length,
+               data, PAGE_SIZE) == PAGE_SIZE ? 0 : -1;
+}
+
+/*
+ * Copy a stored page out, called with its slot lock held. The lock pins
+ * the page's entry; only slots sharing this stripe wait while it is
+ * decompressed.
+ */
+static int frontswap_load_page(struct frontswap_type *fs_type,
+                               struct frontswap_page *page, unsigned char *data)
+{
+    struct frontswap_entry *entry = page->entry;
+    unsigned char buf[PAGE_SIZE];
+    const unsigned char *src;
+
+    if (!page->is_valid)
+        return -1;
+
+    if (page->same_filled) {
+        page_fill(data, page->value);
+        return 0;
+    }
+    if (page->state == FS_PAGE_DISK)
+        return frontswap_read_disk(fs_type, page, data);
+
+    page->referenced = true;
+    src = zs_map_object(frontswap_zpool, entry->handle, buf, entry->length);
+    if (entry->length == PAGE_SIZE) {
+        memcpy(data, src, PAGE_SIZE);
+        return 0;
+    }
+    return frontswap_compressors[entry->comp].decompress(src, entry->length,
+               data, PAGE_SIZE) == PAGE_SIZE ? 0 : -1;
 }
 
 /* Load a page from frontswap */
 static int frontswap_load(unsigned type, unsigned long page_id, unsigned char *data)
 {
     struct frontswap_type *fs_type;
-    int ret = -1;
+    struct frontswap_page *page;
+    pthread_mutex_t *lock;
+    int ret;
 
-    if (type >= MAX_TYPES || !data || page_id == INVALID_SWAP_TYPE)
+    fs_type = frontswap_get_type(type, page_id, 1);
+    if (!fs_type || !data)
         return -1;
 
-    fs_type = frontswap_types[type];
-    if (!fs_type || !fs_type->is_active)
+    page = frontswap_page_lookup(fs_type, page_id, false);
+    if (!page)
         return -1;
+    lock = frontswap_slot_lock(fs_type, page_id);
+
+    pthread_mutex_lock(lock);
+    ret = frontswap_load_page(fs_type, page, data);
+    pthread_mutex_unlock(lock);
+    return ret;
+}
+
+/*
+ * Load nr pages with consecutive ids, with one tree lookup and one slot
+ * lock section per leaf. Returns the number of pages loaded.
+ */
+static int frontswap_load_batch(unsigned type, unsigned long page_id,
+                                unsigned char **pages, unsigned int nr)
+{
+    struct frontswap_type *fs_type;
+    struct frontswap_page *leaf;
+    unsigned int done, n, i;
+    pthread_mutex_t *lock;
+    unsigned long id;
+    int loaded = 0;
 
-    pthread_mutex_lock(&fs_type->lock);
+    fs_type = frontswap_get_type(type, page_id, nr);
+    if (!fs_type || !pages)
+        return 0;
 
-    if (page_id < fs_type->num_pages && fs_type->pages[page_id].is_valid) {
-        memcpy(data, fs_type->pages[page_id].data, PAGE_SIZE);
-        ret = 0;
-    }
+    for (done = 0; done < nr; done += n) {
+        id = page_id + done;
+        n = FS_TREE_SLOTS - (id & FS_TREE_MASK);
+        if (n > nr - done)
+            n = nr - done;
 
-    pthread_mutex_unlock(&fs_type->lock);
-    return ret;
+        leaf = frontswap_page_lookup(fs_type, id, false);
+        if (!leaf)
+            continue;
+
+        lock = frontswap_slot_lock(fs_type, id);
+        pthread_mutex_lock(lock);
+        for (i = 0; i < n; i++) {
+            if (frontswap_load_page(fs_type, &leaf[i], pages[done + i]) == 0)
+                loaded++;
+        }
+        pthread_mutex_unlock(lock);
+    }
+    return loaded;
 }
 
 /* Invalidate a page in frontswap */
 static void frontswap_invalidate_page(unsigned type, unsigned long page_id)
 {
     struct frontswap_type *fs_type;
+    struct frontswap_page *page;
+    pthread_mutex_t *lock;
 
     if (type >= MAX_TYPES || page_id == INVALID_SWAP_TYPE)
         return;
 
     fs_type = frontswap_types[type];
-    if (!fs_type || !fs_type->is_active)
+    if (!fs_type || !fs_type->is_active || page_id >= fs_type->num_pages)
         return;
 
-    pthread_mutex_lock(&fs_type->lock);
+    page = frontswap_page_lookup(fs_type, page_id, false);
+    if (!page)
+        return;
+
+    lock = frontswap_slot_lock(fs_type, page_id);
+    pthread_mutex_lock(lock);
+
+    if (page->is_valid)
+        frontswap_free_page(fs_type, page);
+
+    pthread_mutex_unlock(lock);
+}
+
+/* Free a subtree and every page stored in it */
+static void frontswap_free_node(struct frontswap_type *fs_type,
+                                struct frontswap_node *node)
+{
+    struct frontswap_node *child;
+    unsigned long i;
 
-    if (page_id < fs_type->num_pages && fs_type->pages[page_id].is_valid) {
-        free(fs_type->pages[page_id].data);
-        fs_type->pages[page_id].data = NULL;
-        fs_type->pages[page_id].is_valid = false;
-        fs_type->stored_pages--;
+    for (i = 0; i < FS_TREE_SLOTS; i++) {
+        if (node->shift) {
+            child = atomic_load_explicit(&node->slots[i], memory_order_relaxed);
+            if (child)
+                frontswap_free_node(fs_type, child);
+        } else if (node->pages[i].is_valid) {
+            frontswap_free_page(fs_type, &node->pages[i]);
+        }
     }
+    frontswap_node_discard(fs_type, node);
+}
+
+/*
+ * Free every stored page and the whole index. Like swapoff, this must
+ * not race with other operations on the type, since lookups walk the
+ * tree without locks; writeback is paused for the duration and the
+ * backing file is emptied.
+ */
+static void frontswap_free_all(struct frontswap_type *fs_type)
+{
+    struct frontswap_writeback *wb = fs_type->wb;
+    struct frontswap_node *root;
 
-    pthread_mutex_unlock(&fs_type->lock);
+    if (wb)
+        frontswap_writeback_pause(wb);
+
+    root = atomic_exchange_explicit(&fs_type->root, NULL, memory_order_acq_rel);
+    if (root)
+        frontswap_free_node(fs_type, root);
+
+    if (wb) {
+        if (ftruncate(wb->fd, 0) == 0) {
+            wb->tail = 0;
+            atomic_store(&wb->dead_bytes, 0);
+        }
+        frontswap_writeback_resume(wb);
+    }
 }
 
 /* Invalidate all pages in a frontswap type */
 static void frontswap_invalidate_area(unsigned type)
 {
     struct frontswap_type *fs_type;
-    unsigned long i;
 
     if (type >= MAX_TYPES)
         return;
@@ -165,24 +2110,15 @@ static void frontswap_invalidate_area(unsigned type)
     if (!fs_type || !fs_type->is_active)
         return;
 
-    pthread_mutex_lock(&fs_type->lock);
-
-    for (i = 0; i < fs_type->num_pages; i++) {
-        if (fs_type->pages[i].is_valid) {
-            free(fs_type->pages[i].data);
-            fs_type->pages[i].data = NULL;
-            fs_type->pages[i].is_valid = false;
-        }
-    }
-    fs_type->stored_pages = 0;
-
-    pthread_mutex_unlock(&fs_type->lock);
+    frontswap_free_all(fs_type);
 }
 
 /* Print frontswap statistics */
 static void print_frontswap_stats(unsigned type)
 {
     struct frontswap_type *fs_type;
+    struct frontswap_writeback *wb;
+    unsigned long stored, same, bytes, disk = 0;
 
     if (type >= MAX_TYPES)
         return;
@@ -191,13 +2127,44 @@ static void print_frontswap_stats(unsigned type)
     if (!fs_type)
         return;
 
-    pthread_mutex_lock(&fs_type->lock);
+    wb = fs_type->wb;
+    stored = atomic_load(&fs_type->stored_pages);
+    same = atomic_load(&fs_type->same_filled_pages);
+    bytes = atomic_load(&fs_type->stored_bytes);
+    if (wb)
+        disk = atomic_load(&wb->disk_pages);
+
     printf("\nFrontswap Type %u Statistics:\n", type);
     printf("Total pages: %lu\n", fs_type->num_pages);
-    printf("Stored pages: %lu\n", fs_type->stored_pages);
-    printf("Free pages: %lu\n", fs_type->num_pages - fs_type->stored_pages);
+    printf("Stored pages: %lu\n", stored);
+    printf("Free pages: %lu\n", fs_type->num_pages - stored);
+    printf("Same-filled pages: %lu\n", same);
+    printf("Index nodes: %lu (%lu KB)\n", atomic_load(&fs_type->nr_nodes),
+           atomic_load(&fs_type->node_bytes) >> 10);
+    printf("Compressor: %s\n", atomic_load(&fs_type->comp)->name);
+    printf("Stored bytes: %lu", bytes);
+    if (bytes)
+        printf(" (ratio %.2f)",
+               (double)(stored - same - disk) * PAGE_SIZE / bytes);
+    printf("\n");
+    if (wb) {
+        printf("Writeback: limit %lu bytes, %lu pages (%lu bytes) on disk, "
+               "%lu batches, %lu dead bytes\n", wb->limit, disk,
+               atomic_load(&wb->disk_bytes), atomic_load(&wb->batches),
+               atomic_load(&wb->dead_bytes));
+    }
     printf("Status: %s\n", fs_type->is_active ? "Active" : "Inactive");
-    pthread_mutex_unlock(&fs_type->lock);
+}
+
+/* Print content index statistics, shared by all types */
+static void print_dedup_stats(void)
+{
+    struct frontswap_dedup *dd = &frontswap_dedup;
+    unsigned long entries = atomic_load(&dd->nr_entries);
+    unsigned long refs = atomic_load(&dd->nr_refs);
+
+    printf("Dedup entries: %lu, references: %lu, pages saved: %lu\n",
+           entries, refs, refs - entries);
 }
 
 /* Cleanup frontswap type */
@@ -213,20 +2180,227 @@ static void frontswap_cleanup(unsigned type)
     if (!fs_type)
         return;
 
-    pthread_mutex_lock(&fs_type->lock);
-
-    for (i = 0; i < fs_type->num_pages; i++) {
-        if (fs_type->pages[i].is_valid) {
-            free(fs_type->pages[i].data);
-        }
-    }
+    frontswap_free_all(fs_type);
+    frontswap_disable_writeback(fs_type);
 
-    free(fs_type->pages);
-    pthread_mutex_unlock(&fs_type->lock);
-    pthread_mutex_destroy(&fs_type->lock);
+    for (i = 0; i < FS_SLOT_LOCKS; i++)
+        pthread_mutex_destroy(&fs_type->locks[i].lock);
+    pthread_mutex_destroy(&fs_type->lru_lock);
     free(fs_type);
     frontswap_types[type] = NULL;
     frontswap_enabled_types--;
+
+    if (!frontswap_enabled_types) {
+        zs_destroy_pool(frontswap_zpool);
+        frontswap_zpool = NULL;
+        for (i = 0; i < FS_DEDUP_LOCKS; i++)
+            pthread_mutex_destroy(&frontswap_dedup.locks[i].lock);
+    }
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fill a page with heap-like records (pointers sharing high bits, small
+ * counters, short names, zero padding) that compress roughly 3-4x.
+ */
+static void fill_record_page(unsigned char *page, unsigned int seed)
+{
+    static const char *words[] = {
+        "swap", "page", "cache", "memory", "kernel", "write", "read",
+        "fault", "zone", "node", "slab", "lru", "active", "inactive",
+        "dirty", "clean"
+    };
+    struct {
+        uint64_t next;
+        uint32_t refcount;
+        uint32_t flags;
+        char name[16];
+    } rec;
+    unsigned int i;
+
+    for (i = 0; i + sizeof(rec) <= PAGE_SIZE; i += sizeof(rec)) {
+        seed = seed * 1103515245 + 12345;
+        memset(&rec, 0, sizeof(rec));
+        rec.next = 0x7f3a12000000ULL + ((seed >> 8) & 0xFF) * 32;
+        rec.refcount = (seed >> 24) & 3;
+        rec.flags = 1U << ((seed >> 26) & 3);
+        if (seed & 0x10)
+            snprintf(rec.name, sizeof(rec.name), "%s",
+                     words[(seed >> 16) % 16]);
+        memcpy(page + i, &rec, sizeof(rec));
+    }
+}
+
+/* Store and load MAX_PAGES record pages through one compressor */
+static void bench_compressor(unsigned type, const char *name)
+{
+    static unsigned char pages[MAX_PAGES][PAGE_SIZE];
+    unsigned char out[PAGE_SIZE];
+    unsigned long i, bad = 0, pool_pages;
+    double start, store_gbs, load_gbs;
+    struct frontswap_type *fs_type;
+
+    if (frontswap_set_compressor(type, name) != 0)
+        return;
+    fs_type = frontswap_types[type];
+
+    for (i = 0; i < MAX_PAGES; i++)
+        fill_record_page(pages[i], i);
+
+    pool_pages = zs_get_total_pages(frontswap_zpool);
+    start = now_sec();
+    for (i = 0; i < MAX_PAGES; i++)
+        frontswap_store(type, i, pages[i]);
+    store_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+    pool_pages = zs_get_total_pages(frontswap_zpool) - pool_pages;
+
+    start = now_sec();
+    for (i = 0; i < MAX_PAGES; i++) {
+        if (frontswap_load(type, i, out) != 0 ||
+            memcmp(out, pages[i], PAGE_SIZE) != 0)
+            bad++;
+    }
+    load_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+    printf("%-6s %8.2f %10.2f %10lu %10.2f %9.2f %6lu\n", name,
+           (double)MAX_PAGES * PAGE_SIZE / fs_type->stored_bytes,
+           (double)MAX_PAGES / pool_pages, pool_pages * PAGE_SIZE >> 10,
+           store_gbs, load_gbs, bad);
+
+    frontswap_invalidate_area(type);
+}
+
+/* One thread of the parallel benchmark, owning pages [first, last) */
+struct bench_thread {
+    pthread_t thread;
+    unsigned type;
+    unsigned long first, last;
+    unsigned char (*pages)[PAGE_SIZE];
+    pthread_barrier_t *barrier;
+    unsigned long bad;
+};
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *bt = arg;
+    unsigned char out[PAGE_SIZE];
+    unsigned long i;
+
+    /* Ready, then released once the main thread has read the clock */
+    pthread_barrier_wait(bt->barrier);
+    pthread_barrier_wait(bt->barrier);
+    for (i = bt->first; i < bt->last; i++)
+        frontswap_store(bt->type, i, bt->pages[i]);
+
+    pthread_barrier_wait(bt->barrier);
+    for (i = bt->first; i < bt->last; i++) {
+        if (frontswap_load(bt->type, i, out) != 0 ||
+            memcmp(out, bt->pages[i], PAGE_SIZE) != 0)
+            bt->bad++;
+    }
+    pthread_barrier_wait(bt->barrier);
+    return NULL;
+}
+
+/* Store then load MAX_PAGES distinct pages into one type from nr threads */
+static void bench_parallel(unsigned type, int nr)
+{
+    static unsigned char pages[MAX_PAGES][PAGE_SIZE];
+    struct bench_thread bt[16];
+    pthread_barrier_t barrier;
+    double start, store_end, store_sec, load_sec;
+    unsigned long bad = 0;
+    int t;
+
+    for (t = 0; t < MAX_PAGES; t++)
+        fill_record_page(pages[t], 5000 + t);
+
+    pthread_barrier_init(&barrier, NULL, nr + 1);
+    for (t = 0; t < nr; t++) {
+        bt[t].type = type;
+        bt[t].first = (unsigned long)MAX_PAGES * t / nr;
+        bt[t].last = (unsigned long)MAX_PAGES * (t + 1) / nr;
+        bt[t].pages = pages;
+        bt[t].barrier = &barrier;
+        bt[t].bad = 0;
+        pthread_create(&bt[t].thread, NULL, bench_thread_fn, &bt[t]);
+    }
+
+    /*
+     * Read the clock before the barrier that releases a phase: once it
+     * opens the workers are already running. The end of the store phase
+     * is also the start of the load phase.
+     */
+    pthread_barrier_wait(&barrier);
+    start = now_sec();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    store_end = now_sec();
+    store_sec = store_end - start;
+    pthread_barrier_wait(&barrier);
+    load_sec = now_sec() - store_end;
+
+    for (t = 0; t < nr; t++) {
+        pthread_join(bt[t].thread, NULL);
+        bad += bt[t].bad;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    printf("%7d %10.2f %9.2f %6lu\n", nr,
+           (double)MAX_PAGES * PAGE_SIZE / store_sec / 1e9,
+           (double)MAX_PAGES * PAGE_SIZE / load_sec / 1e9, bad);
+
+    frontswap_invalidate_area(type);
+}
+
+/* Swap out and in MAX_PAGES pages one at a time versus in clusters */
+static void bench_batch(unsigned type, unsigned int cluster)
+{
+    static unsigned char pages[MAX_PAGES][PAGE_SIZE];
+    unsigned char *ptrs[MAX_PAGES];
+    double start, store_gbs, load_gbs;
+    unsigned long i, bad = 0;
+
+    for (i = 0; i < MAX_PAGES; i++) {
+        fill_record_page(pages[i], 3000 + i);
+        ptrs[i] = pages[i];
+    }
+
+    start = now_sec();
+    for (i = 0; i < MAX_PAGES; i += cluster) {
+        if (cluster == 1)
+            frontswap_store(type, i, pages[i]);
+        else
+            frontswap_store_batch(type, i, ptrs + i, cluster);
+    }
+    store_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+    /* Loads overwrite the source pages, so check them against a refill */
+    start = now_sec();
+    for (i = 0; i < MAX_PAGES; i += cluster) {
+        if (cluster == 1)
+            frontswap_load(type, i, pages[i]);
+        else
+            frontswap_load_batch(type, i, ptrs + i, cluster);
+    }
+    load_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+    for (i = 0; i < MAX_PAGES; i++) {
+        unsigned char want[PAGE_SIZE];
+
+        fill_record_page(want, 3000 + i);
+        bad += memcmp(want, pages[i], PAGE_SIZE) != 0;
+    }
+
+    printf("%7u %10.2f %9.2f %6lu\n", cluster, store_gbs, load_gbs, bad);
+    frontswap_invalidate_area(type);
 }
 
 int main()
@@ -261,6 +2435,7 @@ int main()
         printf("Stored page %d in type 0: %s\n", i, ret == 0 ? "Success" : "Failed");
     }
     print_frontswap_stats(0);
+    print_dedup_stats();
 
     /* Test 3: Load pages */
     printf("\nTest 3: Load pages\n");
@@ -296,11 +2471,383 @@ int main()
     printf("Invalidated all pages in type 0\n");
     print_frontswap_stats(0);
 
+    /* Test 6: Compressed storage */
+    printf("\nTest 6: Compressed storage\n");
+    printf("------------------------\n");
+    {
+        unsigned int seed = 42;
+
+        /* Record pages compress; random pages are stored raw */
+        for (i = 0; i < 8; i++) {
+            if (i & 1) {
+                for (int j = 0; j < PAGE_SIZE; j++) {
+                    seed = seed * 1103515245 + 12345;
+                    test_data[j] = seed >> 16;
+                }
+            } else {
+                fill_record_page(test_data, i);
+            }
+            frontswap_store(1, i, test_data);
+            ret = frontswap_load(1, i, read_data);
+            printf("Page %d (%s): stored %u bytes, round trip %s\n", i,
+                   i & 1 ? "random" : "records",
+                   frontswap_page_lookup(frontswap_types[1], i, false)->entry->length,
+                   ret == 0 && memcmp(test_data, read_data, PAGE_SIZE) == 0 ?
+                   "OK" : "FAILED");
+        }
+        print_frontswap_stats(1);
+        printf("Pool pages in use: %lu\n", zs_get_total_pages(frontswap_zpool));
+    }
+
+    /* Test 7: Same-filled pages */
+    printf("\nTest 7: Same-filled pages\n");
+    printf("-----------------------\n");
+    {
+        unsigned long word = 0x0123456789abcdefUL;
+        const char *labels[] = {
+            "zero", "0xAA bytes", "repeated word", "last byte differs",
+            "middle byte differs"
+        };
+
+        for (i = 0; i < 5; i++) {
+            if (i == 0)
+                memset(test_data, 0, PAGE_SIZE);
+            else if (i == 1)
+                memset(test_data, 0xAA, PAGE_SIZE);
+            else
+                for (int j = 0; j < PAGE_SIZE; j += sizeof(word))
+                    memcpy(test_data + j, &word, sizeof(word));
+            if (i == 3)
+                test_data[PAGE_SIZE - 1] ^= 1;
+            if (i == 4)
+                test_data[PAGE_SIZE / 2] ^= 1;
+
+            frontswap_store(1, 20 + i, test_data);
+            memset(read_data, 0x5A, PAGE_SIZE);
+            ret = frontswap_load(1, 20 + i, read_data);
+            printf("%-20s %s, round trip %s\n", labels[i],
+                   frontswap_page_lookup(frontswap_types[1], 20 + i,
+                                         false)->same_filled ?
+                   "fill word" : "compressed",
+                   ret == 0 && memcmp(test_data, read_data, PAGE_SIZE) == 0 ?
+                   "OK" : "FAILED");
+        }
+        print_frontswap_stats(1);
+    }
+
+    /* Test 8: Deduplication across types */
+    printf("\nTest 8: Deduplication across types\n");
+    printf("--------------------------------\n");
+    {
+        struct frontswap_entry *e0, *e1;
+        unsigned long pool_pages;
+
+        fill_record_page(test_data, 1234);
+        frontswap_store(0, 10, test_data);
+        pool_pages = zs_get_total_pages(frontswap_zpool);
+        frontswap_store(1, 30, test_data);
+        frontswap_store(1, 31, test_data);
+        e0 = frontswap_page_lookup(frontswap_types[0], 10, false)->entry;
+        e1 = frontswap_page_lookup(frontswap_types[1], 30, false)->entry;
+        printf("Shared entry: %s, refcount %u, pool pages added: %lu\n",
+               e0 == e1 ? "yes" : "no", e0->refcount,
+               zs_get_total_pages(frontswap_zpool) - pool_pages);
+        print_dedup_stats();
+
+        /* A page differing in one byte must not match */
+        test_data[100] ^= 1;
+        frontswap_store(1, 32, test_data);
+        printf("Modified page shares entry: %s\n",
+               frontswap_page_lookup(frontswap_types[1], 32,
+                                     false)->entry == e0 ? "yes" : "no");
+        frontswap_invalidate_page(1, 32);
+        test_data[100] ^= 1;
+
+        frontswap_invalidate_page(0, 10);
+        frontswap_invalidate_page(1, 30);
+        ret = frontswap_load(1, 31, read_data);
+        printf("After dropping two references: refcount %u, load %s\n",
+               e1->refcount,
+               ret == 0 && memcmp(test_data, read_data, PAGE_SIZE) == 0 ?
+               "OK" : "FAILED");
+        frontswap_invalidate_page(1, 31);
+        print_dedup_stats();
+    }
+
+    /* Test 9: Sparse page ids */
+    printf("\nTest 9: Sparse page ids\n");
+    printf("---------------------\n");
+    {
+        unsigned long ids[] = {
+            0, 63, 64, 1UL << 20, 1UL << 28, 1UL << 40, INVALID_SWAP_TYPE - 1
+        };
+        unsigned int k;
+
+        /* A type spanning the whole 64-bit id space */
+        ret = frontswap_init(6, INVALID_SWAP_TYPE);
+        printf("Initialized full-range type 6: %s\n",
+               ret == 0 ? "Success" : "Failed");
+
+        for (k = 0; k < sizeof(ids) / sizeof(ids[0]); k++) {
+            fill_record_page(test_data, k);
+            ret = frontswap_store(6, ids[k], test_data);
+            if (ret == 0)
+                ret = frontswap_load(6, ids[k], read_data);
+            printf("Page id %#lx: round trip %s, index nodes %lu\n", ids[k],
+                   ret == 0 && memcmp(test_data, read_data, PAGE_SIZE) == 0 ?
+                   "OK" : "FAILED", atomic_load(&frontswap_types[6]->nr_nodes));
+        }
+
+        ret = frontswap_load(6, 1UL << 30, read_data);
+        printf("Loading never-stored id 0x40000000: %s\n",
+               ret == 0 ? "Success" : "Failed");
+        frontswap_invalidate_page(6, 1UL << 40);
+        ret = frontswap_load(6, 1UL << 40, read_data);
+        printf("Loading invalidated id 0x10000000000: %s\n",
+               ret == 0 ? "Success" : "Failed");
+        print_frontswap_stats(6);
+        frontswap_cleanup(6);
+    }
+
+    /* Test 10: Writeback of cold pages */
+    printf("\nTest 10: Writeback of cold pages\n");
+    printf("------------------------------\n");
+    {
+        static unsigned char pages[256][PAGE_SIZE];
+        unsigned long bad = 0, bytes;
+        int hot;
+
+        frontswap_init(7, 256);
+        ret = frontswap_enable_writeback(7, "/tmp/frontswap_wb.7", 64 << 10);
+        printf("Enabled writeback with a 64 KB limit: %s\n",
+               ret == 0 ? "Success" : "Failed");
+
+        /* Keep the first pages hot so the scan gives them a second chance */
+        for (i = 0; i < 256; i++) {
+            fill_record_page(pages[i], 9000 + i);
+            if (frontswap_store(7, i, pages[i]) != 0)
+                bad++;
+            for (hot = 0; hot < 8 && hot < i; hot++)
+                frontswap_load(7, hot, read_data);
+        }
+        frontswap_writeback_sync(7);
+        printf("Rejected stores: %lu\n", bad);
+        print_frontswap_stats(7);
+
+        /* Writeback evicts the overshoot, not whole batches */
+        bytes = atomic_load(&frontswap_types[7]->stored_bytes);
+        printf("Stored bytes within a page of the limit: %s\n",
+               bytes <= 64 << 10 && bytes + PAGE_SIZE > 64 << 10 ?
+               "yes" : "no");
+
+        for (i = 0, hot = 0; i < 8; i++) {
+            struct frontswap_page *page;
+
+            page = frontswap_page_lookup(frontswap_types[7], i, false);
+            pthread_mutex_lock(frontswap_slot_lock(frontswap_types[7], i));
+            hot += page->state == FS_PAGE_MEM;
+            pthread_mutex_unlock(frontswap_slot_lock(frontswap_types[7], i));
+        }
+        printf("Hot pages still in memory: %d of 8\n", hot);
+
+        for (i = 0, bad = 0; i < 256; i++) {
+            if (frontswap_load(7, i, read_data) != 0 ||
+                memcmp(read_data, pages[i], PAGE_SIZE) != 0)
+                bad++;
+        }
+        printf("Loaded all 256 pages: %lu errors\n", bad);
+
+        for (i = 100; i < 110; i++)
+            frontswap_invalidate_page(7, i);
+        print_frontswap_stats(7);
+        frontswap_cleanup(7);
+    }
+
+    /* Test 11: Batched store and load */
+    printf("\nTest 11: Batched store and load\n");
+    printf("-----------------------------\n");
+    {
+        static unsigned char pages[16][PAGE_SIZE], out[16][PAGE_SIZE];
+        unsigned char *in_ptrs[16], *out_ptrs[16];
+        int n, bad = 0;
+
+        for (i = 0; i < 16; i++) {
+            fill_record_page(pages[i], 7000 + i);
+            in_ptrs[i] = pages[i];
+            out_ptrs[i] = out[i];
+        }
+        memset(pages[5], 0, PAGE_SIZE);
+
+        /* Ids 56..71 cross a leaf boundary; id 60 is already in use */
+        frontswap_store(0, 60, pages[4]);
+        n = frontswap_store_batch(0, 56, in_ptrs, 16);
+        printf("Stored %d of 16 pages (one slot was taken)\n", n);
+        n = frontswap_load_batch(0, 56, out_ptrs, 16);
+        for (i = 0; i < 16; i++)
+            bad += memcmp(out[i], pages[i], PAGE_SIZE) != 0;
+        printf("Loaded %d of 16 pages, %d mismatches\n", n, bad);
+        n = frontswap_store_batch(0, 95, in_ptrs, 16);
+        printf("Batch past the end of type 0: stored %d pages\n", n);
+        frontswap_invalidate_area(0);
+    }
+
+    /* Test 12: Global pool limit */
+    printf("\nTest 12: Global pool limit\n");
+    printf("------------------------\n");
+    {
+        static unsigned char pages[96][PAGE_SIZE];
+        unsigned long freed;
+        int stored;
+
+        for (i = 0; i < 96; i++)
+            fill_record_page(pages[i], 11000 + i);
+
+        /* Types 3 and 4 can write back, type 5 cannot */
+        frontswap_init(3, 64);
+        frontswap_init(4, 64);
+        frontswap_init(5, 64);
+        frontswap_enable_writeback(3, "/tmp/frontswap_wb.3", 0);
+        frontswap_enable_writeback(4, "/tmp/frontswap_wb.4", 0);
+        frontswap_invalidate_area(0);
+        frontswap_invalidate_area(1);
+
+        frontswap_set_max_pool_percent(20, 90);
+        printf("20%% of physical memory: %lu MB\n",
+               frontswap_limit.max_bytes >> 20);
+        frontswap_set_pool_limit(96 << 10, 50);
+
+        /* Let each shrink kicked by a store finish before the next one */
+        for (i = 0, stored = 0; i < 64; i++) {
+            stored += frontswap_store(i < 48 ? 3 : 4, i, pages[i]) == 0;
+            frontswap_pool_shrink_wait();
+        }
+        printf("Stored %d of 64 pages into writeback types 3 and 4\n", stored);
+        print_pool_limit_stats();
+        printf("Pages on disk: type 3 %lu, type 4 %lu\n",
+               atomic_load(&frontswap_types[3]->wb->disk_pages),
+               atomic_load(&frontswap_types[4]->wb->disk_pages));
+
+        /* Reclaim explicitly: the larger type gives up pages first */
+        freed = frontswap_shrink(32 << 10);
+        printf("Shrink by 32 KB freed %lu KB; on disk: type 3 %lu, type 4 %lu\n",
+               freed >> 10, atomic_load(&frontswap_types[3]->wb->disk_pages),
+               atomic_load(&frontswap_types[4]->wb->disk_pages));
+
+        /* Type 5 cannot be shrunk, so the limit ends up refusing its pages */
+        for (i = 64, stored = 0; i < 96; i++) {
+            stored += frontswap_store(5, i - 64, pages[i]) == 0;
+            frontswap_pool_shrink_wait();
+        }
+        printf("Stored %d of 32 pages into type 5\n", stored);
+        memset(test_data, 0, PAGE_SIZE);
+        ret = frontswap_store(5, 63, test_data);
+        printf("Zero page while full: %s\n", ret == 0 ? "Success" : "Failed");
+        print_pool_limit_stats();
+
+        for (i = 0, ret = 0; i < 48; i++)
+            ret += frontswap_load(3, i, read_data) == 0 &&
+                   memcmp(read_data, pages[i], PAGE_SIZE) == 0;
+        printf("Type 3 pages readable: %d of 48\n", ret);
+
+        frontswap_set_pool_limit(0, 90);
+        frontswap_cleanup(3);
+        frontswap_cleanup(4);
+        frontswap_cleanup(5);
+    }
+
     /* Cleanup */
     printf("\nCleaning up frontswap\n");
     frontswap_cleanup(0);
     frontswap_cleanup(1);
     printf("Frontswap cleanup complete\n");
 
+    /* Benchmark 1: Compression ratio and throughput */
+    printf("\nBenchmark 1: Compression (%d record pages)\n", MAX_PAGES);
+    printf("----------------------------------------\n");
+    if (frontswap_init(2, MAX_PAGES) != 0)
+        return 1;
+    printf("%-6s %8s %10s %10s %10s %9s %6s\n", "comp", "ratio",
+           "pages/page", "pool KB", "store GB/s", "load GB/s", "errors");
+    bench_compressor(2, "none");
+    bench_compressor(2, "lz4");
+
+    /* Benchmark 2: Zero pages through the same-filled fast path */
+    printf("\nBenchmark 2: Zero pages (%d pages)\n", MAX_PAGES);
+    printf("--------------------------------\n");
+    {
+        double start, store_gbs, load_gbs;
+
+        memset(test_data, 0, PAGE_SIZE);
+        start = now_sec();
+        for (i = 0; i < MAX_PAGES; i++)
+            frontswap_store(2, i, test_data);
+        store_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+        start = now_sec();
+        for (i = 0; i < MAX_PAGES; i++)
+            frontswap_load(2, i, read_data);
+        load_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+        printf("Same-filled pages: %lu, pool pages: %lu\n",
+               frontswap_types[2]->same_filled_pages,
+               zs_get_total_pages(frontswap_zpool));
+        printf("Store %.2f GB/s, load %.2f GB/s\n", store_gbs, load_gbs);
+    }
+    frontswap_invalidate_area(2);
+
+    /* Benchmark 3: Tenants storing overlapping page sets */
+    printf("\nBenchmark 3: Duplicate pages (%d pages, 4 tenants)\n", MAX_PAGES);
+    printf("-----------------------------------------------\n");
+    {
+        static unsigned char pages[MAX_PAGES / 4][PAGE_SIZE];
+        double start, store_gbs;
+        unsigned long bad = 0;
+        int t;
+
+        for (i = 0; i < MAX_PAGES / 4; i++)
+            fill_record_page(pages[i], i);
+        for (t = 3; t < 6; t++)
+            frontswap_init(t, MAX_PAGES / 4);
+
+        /* Every tenant swaps out the same images */
+        start = now_sec();
+        for (t = 2; t < 6; t++)
+            for (i = 0; i < MAX_PAGES / 4; i++)
+                frontswap_store(t, i, pages[i]);
+        store_gbs = (double)MAX_PAGES * PAGE_SIZE / (now_sec() - start) / 1e9;
+
+        for (t = 2; t < 6; t++) {
+            for (i = 0; i < MAX_PAGES / 4; i++) {
+                if (frontswap_load(t, i, read_data) != 0 ||
+                    memcmp(read_data, pages[i], PAGE_SIZE) != 0)
+                    bad++;
+            }
+        }
+
+        print_dedup_stats();
+        printf("Pool pages: %lu for %d stored pages\n",
+               zs_get_total_pages(frontswap_zpool), MAX_PAGES);
+        printf("Store %.2f GB/s, errors %lu\n", store_gbs, bad);
+
+        for (t = 3; t < 6; t++)
+            frontswap_cleanup(t);
+    }
+    frontswap_invalidate_area(2);
+
+    /* Benchmark 4: Parallel store/load on one type */
+    printf("\nBenchmark 4: Parallel store/load (%d pages, one type)\n", MAX_PAGES);
+    printf("-------------------------------------------------\n");
+    printf("%7s %10s %9s %6s\n", "threads", "store GB/s", "load GB/s", "errors");
+    for (i = 1; i <= 16; i *= 2)
+        bench_parallel(2, i);
+
+    /* Benchmark 5: Single-page calls versus swap cluster batches */
+    printf("\nBenchmark 5: Batched store/load (%d pages)\n", MAX_PAGES);
+    printf("---------------------------------------\n");
+    printf("%7s %10s %9s %6s\n", "cluster", "store GB/s", "load GB/s", "errors");
+    for (i = 1; i <= 64; i *= 4)
+        bench_batch(2, i);
+    frontswap_cleanup(2);
+
     return 0;
 }
@@ -1,17 +1,65 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-/* Simplified kfifo implementation */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Simplified kfifo implementation. As in the kernel, one producer and one
+ * consumer may use a fifo concurrently without locking: in is written
+ * only by the producer and out only by the consumer, each published with
+ * release and read with acquire ordering. The two indices live on
+ * separate cache lines, next to a cached copy of the opposite index, so
+ * the other side's line is only pulled in when the cached view runs out
+ * of room or data.
+ */
 struct kfifo {
     unsigned char *buffer;
     unsigned int size;
-    unsigned int in;
-    unsigned int out;
     unsigned int mask;
+    int mirrored;               /* buffer is mapped twice back-to-back */
+    unsigned int data_offset;   /* Shared fifo: ring follows at this offset */
+
+    /* Producer side */
+    atomic_uint in __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int out_cache;     /* Last out seen by the producer */
+
+    /* Consumer side */
+    atomic_uint out __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int in_cache;      /* Last in seen by the consumer */
+
+    /* Sleepers in kfifo_out_wait/kfifo_in_wait, 0 when nobody sleeps */
+    atomic_uint consumer_need __attribute__((aligned(CACHE_LINE_SIZE)));
+    atomic_uint producer_need;
+    unsigned int wake_threshold;
+    atomic_ulong nr_wakeups;
 };
 
+/*
+ * Ring storage. A shared fifo may be mapped at a different address in
+ * each process, so it records where its ring lives relative to itself
+ * instead of keeping a pointer.
+ */
+static inline unsigned char *kfifo_data(struct kfifo *fifo)
+{
+    return fifo->data_offset ? (unsigned char *)fifo + fifo->data_offset
+                             : fifo->buffer;
+}
+
 /* Helper macros */
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -42,9 +90,17 @@ int kfifo_init(struct kfifo *fifo, unsigned char *buffer, unsigned int size)
 
     fifo->buffer = buffer;
     fifo->size = size;
-    fifo->in = 0;
-    fifo->out = 0;
     fifo->mask = size - 1;
+    fifo->mirrored = 0;
+    fifo->data_offset = 0;
+    atomic_init(&fifo->in, 0);
+    atomic_init(&fifo->out, 0);
+    fifo->out_cache = 0;
+    fifo->in_cache = 0;
+    atomic_init(&fifo->consumer_need, 0);
+    atomic_init(&fifo->producer_need, 0);
+    fifo->wake_threshold = 1;
+    atomic_init(&fifo->nr_wakeups, 0);
 
     return 0;
 }
@@ -58,7 +114,7 @@ struct kfifo *kfifo_alloc(unsigned int size)
     /* Round up size to power of 2 */
     size = roundup_pow_of_two(size);
 
-    fifo = malloc(sizeof(*fifo));
+    fifo = aligned_alloc(CACHE_LINE_SIZE, sizeof(*fifo));
     if (!fifo)
         return NULL;
 
@@ -72,66 +128,561 @@ struct kfifo *kfifo_alloc(unsigned int size)
     return fifo;
 }
 
-/* Free kfifo */
+/*
+ * Allocate a kfifo whose buffer is mapped twice, back-to-back, from one
+ * memfd. A region of up to size bytes starting anywhere in the first
+ * mapping is then virtually contiguous, so copies never split at the
+ * wrap and callers can parse queued data through a single pointer. The
+ * size is rounded up to a power of two of at least one page.
+ */
+struct kfifo *kfifo_alloc_mirrored(unsigned int size)
+{
+    unsigned int page = sysconf(_SC_PAGESIZE);
+    struct kfifo *fifo;
+    unsigned char *area;
+    int fd;
+
+    size = roundup_pow_of_two(size < page ? page : size);
+
+    fifo = aligned_alloc(CACHE_LINE_SIZE, sizeof(*fifo));
+    if (!fifo)
+        return NULL;
+
+    fd = memfd_create("kfifo", MFD_CLOEXEC);
+    if (fd < 0)
+        goto err_free;
+    if (ftruncate(fd, size) < 0)
+        goto err_close;
+
+    /* Reserve both halves first so nothing else can land in between */
+    area = mmap(NULL, 2 * (size_t)size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        goto err_close;
+
+    if (mmap(area, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(area + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(area, 2 * (size_t)size);
+        goto err_close;
+    }
+    /* The mappings keep the memory alive */
+    close(fd);
+
+    kfifo_init(fifo, area, size);
+    fifo->mirrored = 1;
+    return fifo;
+
+err_close:
+    close(fd);
+err_free:
+    free(fifo);
+    return NULL;
+}
+
+/*
+ * Create a fifo in the named POSIX shared-memory segment name, for a
+ * producer and a consumer in different processes. struct kfifo is placed
+ * at the start of the segment with the ring right behind it, and nothing
+ * in it is a pointer, so every process can map it anywhere. Several
+ * producers feeding one collector each get their own fifo. The creator
+ * must have returned before a peer calls kfifo_attach_shared().
+ */
+struct kfifo *kfifo_create_shared(const char *name, unsigned int size)
+{
+    size_t hdr = (sizeof(struct kfifo) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    struct kfifo *fifo;
+    int fd;
+
+    size = roundup_pow_of_two(size);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, hdr + size) < 0)
+        goto err_unlink;
+
+    fifo = mmap(NULL, hdr + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fifo == MAP_FAILED)
+        goto err_unlink;
+    close(fd);
+
+    kfifo_init(fifo, NULL, size);
+    fifo->data_offset = hdr;
+    return fifo;
+
+err_unlink:
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+}
+
+/* Map a fifo made by kfifo_create_shared() in another process */
+struct kfifo *kfifo_attach_shared(const char *name)
+{
+    struct kfifo *fifo;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*fifo)) {
+        close(fd);
+        return NULL;
+    }
+
+    fifo = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (fifo == MAP_FAILED)
+        return NULL;
+
+    /* Refuse anything that is not laid out the way we would create it */
+    if (!is_power_of_2(fifo->size) || fifo->data_offset < sizeof(*fifo) ||
+        (size_t)fifo->data_offset + fifo->size != (size_t)st.st_size) {
+        munmap(fifo, st.st_size);
+        return NULL;
+    }
+    return fifo;
+}
+
+/* Free kfifo, or for a shared one just unmap it; see shm_unlink() */
 void kfifo_free(struct kfifo *fifo)
 {
     if (fifo) {
-        free(fifo->buffer);
+        if (fifo->data_offset) {
+            /* Shared: only drop this process's mapping */
+            munmap(fifo, (size_t)fifo->data_offset + fifo->size);
+            return;
+        }
+        if (fifo->mirrored)
+            munmap(fifo->buffer, 2 * (size_t)fifo->size);
+        else
+            free(fifo->buffer);
         free(fifo);
     }
 }
 
-/* Put data into kfifo */
-unsigned int kfifo_in(struct kfifo *fifo, const unsigned char *buffer, unsigned int len)
+/*
+ * Space the producer may fill, refreshing the cached out index only when
+ * the cached view is too small for len bytes
+ */
+static inline unsigned int kfifo_avail_in(struct kfifo *fifo, unsigned int in,
+                                          unsigned int len)
 {
+    unsigned int avail = fifo->size - (in - fifo->out_cache);
+
+    if (avail < len) {
+        fifo->out_cache = atomic_load_explicit(&fifo->out, memory_order_acquire);
+        avail = fifo->size - (in - fifo->out_cache);
+    }
+    return avail;
+}
+
+/* Data the consumer may take, refreshing the cached in index as needed */
+static inline unsigned int kfifo_avail_out(struct kfifo *fifo, unsigned int out,
+                                           unsigned int len)
+{
+    unsigned int avail = fifo->in_cache - out;
+
+    if (avail < len) {
+        fifo->in_cache = atomic_load_explicit(&fifo->in, memory_order_acquire);
+        avail = fifo->in_cache - out;
+    }
+    return avail;
+}
+
+/* Copy len bytes into the ring at index off, wrapping at the end */
+static void kfifo_copy_in(struct kfifo *fifo, const unsigned char *src,
+                          unsigned int len, unsigned int off)
+{
+    unsigned char *data = kfifo_data(fifo);
     unsigned int l;
-    len = min(len, fifo->size - (fifo->in - fifo->out));
 
-    /* First put the data starting from fifo->in to buffer end */
-    l = min(len, fifo->size - (fifo->in & fifo->mask));
-    memcpy(fifo->buffer + (fifo->in & fifo->mask), buffer, l);
+    off &= fifo->mask;
+
+    /* First put the data starting from off to buffer end */
+    l = fifo->mirrored ? len : min(len, fifo->size - off);
+    memcpy(data + off, src, l);
 
     /* Then put the rest (if any) at the beginning of the buffer */
-    memcpy(fifo->buffer, buffer + l, len - l);
+    memcpy(data, src + l, len - l);
+}
+
+/* Copy len bytes out of the ring from index off, wrapping at the end */
+static void kfifo_copy_out(struct kfifo *fifo, unsigned char *dst,
+                           unsigned int len, unsigned int off)
+{
+    unsigned char *data = kfifo_data(fifo);
+    unsigned int l;
+
+    off &= fifo->mask;
+
+    /* First get the data from off until the end of the buffer */
+    l = fifo->mirrored ? len : min(len, fifo->size - off);
+    memcpy(dst, data + off, l);
 
-    fifo->in += len;
+    /* Then get the rest (if any) from the beginning of the buffer */
+    memcpy(dst + l, data, len - l);
+}
+
+/* Put data into kfifo, called by the producer only */
+unsigned int kfifo_in(struct kfifo *fifo, const unsigned char *buffer, unsigned int len)
+{
+    unsigned int in, avail;
+
+    in = atomic_load_explicit(&fifo->in, memory_order_relaxed);
+    avail = kfifo_avail_in(fifo, in, len);
+    len = min(len, avail);
+
+    kfifo_copy_in(fifo, buffer, len, in);
+
+    /* Publish the data before the new index */
+    atomic_store_explicit(&fifo->in, in + len, memory_order_release);
     return len;
 }
 
-/* Get data from kfifo */
+/* Get data from kfifo, called by the consumer only */
 unsigned int kfifo_out(struct kfifo *fifo, unsigned char *buffer, unsigned int len)
 {
-    unsigned int l;
-    len = min(len, fifo->in - fifo->out);
+    unsigned int out, avail;
 
-    /* First get the data from fifo->out until the end of the buffer */
-    l = min(len, fifo->size - (fifo->out & fifo->mask));
-    memcpy(buffer, fifo->buffer + (fifo->out & fifo->mask), l);
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    avail = kfifo_avail_out(fifo, out, len);
+    len = min(len, avail);
 
-    /* Then get the rest (if any) from the beginning of the buffer */
-    memcpy(buffer + l, fifo->buffer, len - l);
+    kfifo_copy_out(fifo, buffer, len, out);
+
+    /*
+     * Indices run freely and wrap through unsigned arithmetic, so there
+     * is no reset when the fifo drains; the release orders our reads of
+     * the data before the producer may overwrite it.
+     */
+    atomic_store_explicit(&fifo->out, out + len, memory_order_release);
+    return len;
+}
+
+/*
+ * Blocking waits. The consumer sleeps on a futex on the in index itself,
+ * and the producer on out, so no separate sequence word is needed; the
+ * futex call fails at once if the index moved after the sleeper looked.
+ * A sleeper only goes to sleep on an empty (full) fifo and advertises how
+ * many bytes (free bytes) it wants in consumer_need (producer_need); the
+ * other side wakes it once that much is available, which lets a busy
+ * queue batch wakeups instead of making a syscall per item. Both sides
+ * of a fifo that uses these must go through the _wait calls, since plain
+ * kfifo_in/kfifo_out never wake anybody.
+ */
+static long futex(atomic_uint *uaddr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
 
-    fifo->out += len;
+/* Wake a sleeper on the other side once it can make its wanted progress */
+static void kfifo_wake(struct kfifo *fifo, atomic_uint *need, atomic_uint *word,
+                       unsigned int avail)
+{
+    unsigned int n;
 
-    /* Ensure out is bounded by size */
-    if (fifo->out == fifo->in) {
-        fifo->out = 0;
-        fifo->in = 0;
+    /* Pairs with the fence a sleeper takes after advertising its need */
+    atomic_thread_fence(memory_order_seq_cst);
+    n = atomic_load_explicit(need, memory_order_relaxed);
+    if (n && avail >= n && atomic_exchange(need, 0)) {
+        atomic_fetch_add_explicit(&fifo->nr_wakeups, 1, memory_order_relaxed);
+        futex(word, fifo->data_offset ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1);
     }
+}
 
+/*
+ * Sleep until *word moves away from val, unless it already has. The
+ * caller rechecks the fifo afterwards, so spurious wakeups are harmless.
+ */
+static void kfifo_sleep(struct kfifo *fifo, atomic_uint *need, atomic_uint *word,
+                        unsigned int val, unsigned int n)
+{
+    atomic_store_explicit(need, n, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(word, memory_order_relaxed) == val)
+        futex(word, fifo->data_offset ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val);
+    atomic_store_explicit(need, 0, memory_order_relaxed);
+}
+
+/*
+ * Only wake a sleeping peer once it can move at least bytes at a time
+ * (capped at what it asked for). A producer that stops short of a batch
+ * must call kfifo_in_flush() so the consumer sees the tail.
+ */
+void kfifo_set_wake_threshold(struct kfifo *fifo, unsigned int bytes)
+{
+    fifo->wake_threshold = bytes ? min(bytes, fifo->size) : 1;
+}
+
+/* Wake a sleeping consumer regardless of the threshold; producer only */
+void kfifo_in_flush(struct kfifo *fifo)
+{
+    kfifo_wake(fifo, &fifo->consumer_need, &fifo->in, fifo->size);
+}
+
+/* Put at least one byte, sleeping while full; producer only */
+unsigned int kfifo_in_wait(struct kfifo *fifo, const unsigned char *buffer,
+                           unsigned int len)
+{
+    unsigned int ret, in, out;
+
+    if (!len)
+        return 0;
+
+    while (!(ret = kfifo_in(fifo, buffer, len))) {
+        out = atomic_load_explicit(&fifo->out, memory_order_acquire);
+        if (out != fifo->out_cache)
+            continue;
+        kfifo_sleep(fifo, &fifo->producer_need, &fifo->out, out,
+                    min(len, fifo->wake_threshold));
+    }
+
+    in = atomic_load_explicit(&fifo->in, memory_order_relaxed);
+    kfifo_wake(fifo, &fifo->consumer_need, &fifo->in,
+               in - atomic_load_explicit(&fifo->out, memory_order_relaxed));
+    return ret;
+}
+
+/* Get at least one byte, sleeping while empty; consumer only */
+unsigned int kfifo_out_wait(struct kfifo *fifo, unsigned char *buffer,
+                            unsigned int len)
+{
+    unsigned int ret, in, out;
+
+    if (!len)
+        return 0;
+
+    while (!(ret = kfifo_out(fifo, buffer, len))) {
+        in = atomic_load_explicit(&fifo->in, memory_order_acquire);
+        if (in != fifo->in_cache)
+            continue;
+        kfifo_sleep(fifo, &fifo->consumer_need, &fifo->in, in,
+                    min(len, fifo->wake_threshold));
+    }
+
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    kfifo_wake(fifo, &fifo->producer_need, &fifo->out,
+               fifo->size - (atomic_load_explicit(&fifo->in, memory_order_relaxed) - out));
+    return ret;
+}
+
+/*
+ * Zero-copy access. The prepare/peek calls describe up to len bytes of
+ * free space or queued data as at most two iovecs (two when the region
+ * wraps past the end of the buffer) so the caller can work in the ring
+ * directly, then the commit/consume call publishes the bytes actually
+ * used. A mirrored fifo always needs just the first iovec. As with
+ * kfifo_in/kfifo_out, only the producer may call the _in pair and only
+ * the consumer the _out pair.
+ */
+static void kfifo_fill_iov(struct kfifo *fifo, unsigned int off,
+                           unsigned int len, struct iovec *iov)
+{
+    unsigned int l;
+
+    off &= fifo->mask;
+    l = fifo->mirrored ? len : min(len, fifo->size - off);
+
+    iov[0].iov_base = kfifo_data(fifo) + off;
+    iov[0].iov_len = l;
+    iov[1].iov_base = kfifo_data(fifo);
+    iov[1].iov_len = len - l;
+}
+
+/* Describe up to len bytes of free space; returns the bytes described */
+unsigned int kfifo_prepare_in(struct kfifo *fifo, unsigned int len,
+                              struct iovec iov[2])
+{
+    unsigned int in, avail;
+
+    in = atomic_load_explicit(&fifo->in, memory_order_relaxed);
+    avail = kfifo_avail_in(fifo, in, len);
+    len = min(len, avail);
+    kfifo_fill_iov(fifo, in, len, iov);
+    return len;
+}
+
+/* Publish len bytes written into the space from kfifo_prepare_in() */
+void kfifo_commit_in(struct kfifo *fifo, unsigned int len)
+{
+    unsigned int in = atomic_load_explicit(&fifo->in, memory_order_relaxed);
+
+    atomic_store_explicit(&fifo->in, in + len, memory_order_release);
+}
+
+/* Describe up to len bytes of queued data; returns the bytes described */
+unsigned int kfifo_peek_out(struct kfifo *fifo, unsigned int len,
+                            struct iovec iov[2])
+{
+    unsigned int out, avail;
+
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    avail = kfifo_avail_out(fifo, out, len);
+    len = min(len, avail);
+    kfifo_fill_iov(fifo, out, len, iov);
     return len;
 }
 
+/* Release len bytes of data handed out by kfifo_peek_out() */
+void kfifo_consume_out(struct kfifo *fifo, unsigned int len)
+{
+    unsigned int out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+
+    atomic_store_explicit(&fifo->out, out + len, memory_order_release);
+}
+
+/* Read up to len bytes from fd straight into the fifo, producer only */
+ssize_t kfifo_from_fd(struct kfifo *fifo, int fd, unsigned int len)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    len = kfifo_prepare_in(fifo, len, iov);
+    if (!len)
+        return 0;
+
+    ret = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (ret > 0)
+        kfifo_commit_in(fifo, ret);
+    return ret;
+}
+
+/* Write up to len queued bytes straight to fd, consumer only */
+ssize_t kfifo_to_fd(struct kfifo *fifo, int fd, unsigned int len)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    len = kfifo_peek_out(fifo, len, iov);
+    if (!len)
+        return 0;
+
+    ret = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (ret > 0)
+        kfifo_consume_out(fifo, ret);
+    return ret;
+}
+
+/*
+ * Record mode. Each record is stored as a little-endian length header of
+ * recsize (1 or 2) bytes followed by the payload, and the producer
+ * publishes header and payload with a single index update, so a consumer
+ * never sees half a record. Byte-stream and record calls must not be
+ * mixed on one fifo, and both sides must agree on recsize.
+ */
+#define KFIFO_REC_MAX(recsize) ((1U << ((recsize) * 8)) - 1)
+
+/* Read the header of the record at index off */
+static unsigned int kfifo_peek_hdr(struct kfifo *fifo, unsigned int off,
+                                   unsigned int recsize)
+{
+    unsigned char *data = kfifo_data(fifo);
+    unsigned int n;
+
+    n = data[off & fifo->mask];
+    if (recsize > 1)
+        n |= data[(off + 1) & fifo->mask] << 8;
+    return n;
+}
+
+/* Store a record header at index off */
+static void kfifo_poke_hdr(struct kfifo *fifo, unsigned int n, unsigned int off,
+                           unsigned int recsize)
+{
+    unsigned char *data = kfifo_data(fifo);
+
+    data[off & fifo->mask] = n & 0xff;
+    if (recsize > 1)
+        data[(off + 1) & fifo->mask] = (n >> 8) & 0xff;
+}
+
+/*
+ * Queue one record of len bytes, called by the producer only. Returns len,
+ * or 0 if the whole record does not fit or len exceeds what the header can
+ * describe; nothing is queued in that case.
+ */
+unsigned int kfifo_in_rec(struct kfifo *fifo, const unsigned char *buffer,
+                          unsigned int len, unsigned int recsize)
+{
+    unsigned int in;
+
+    if (recsize < 1 || recsize > 2 || len > KFIFO_REC_MAX(recsize))
+        return 0;
+
+    in = atomic_load_explicit(&fifo->in, memory_order_relaxed);
+    if (kfifo_avail_in(fifo, in, len + recsize) < len + recsize)
+        return 0;
+
+    kfifo_poke_hdr(fifo, len, in, recsize);
+    kfifo_copy_in(fifo, buffer, len, in + recsize);
+
+    atomic_store_explicit(&fifo->in, in + recsize + len, memory_order_release);
+    return len;
+}
+
+/* Length of the next record, or 0 if the fifo is empty; consumer only */
+unsigned int kfifo_peek_len(struct kfifo *fifo, unsigned int recsize)
+{
+    unsigned int out;
+
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    if (kfifo_avail_out(fifo, out, recsize) < recsize)
+        return 0;
+    return kfifo_peek_hdr(fifo, out, recsize);
+}
+
+/*
+ * Dequeue the next record into buffer, called by the consumer only.
+ * Returns the number of bytes copied. As in the kernel, a record longer
+ * than len is truncated to len but still removed as a whole, so use
+ * kfifo_peek_len() first when the size is not bounded.
+ */
+unsigned int kfifo_out_rec(struct kfifo *fifo, unsigned char *buffer,
+                           unsigned int len, unsigned int recsize)
+{
+    unsigned int out, n;
+
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    if (kfifo_avail_out(fifo, out, recsize) < recsize)
+        return 0;
+
+    /* The producer published header and payload together */
+    n = kfifo_peek_hdr(fifo, out, recsize);
+    len = min(len, n);
+    kfifo_copy_out(fifo, buffer, len, out + recsize);
+
+    atomic_store_explicit(&fifo->out, out + recsize + n, memory_order_release);
+    return len;
+}
+
+/* Drop the next record without copying it; consumer only */
+void kfifo_skip_rec(struct kfifo *fifo, unsigned int recsize)
+{
+    unsigned int out;
+
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);
+    if (kfifo_avail_out(fifo, out, recsize) < recsize)
+        return;
+    atomic_store_explicit(&fifo->out,
+                          out + recsize + kfifo_peek_hdr(fifo, out, recsize),
+                          memory_order_release);
+}
+
 /* Get fifo length */
 static inline unsigned int kfifo_len(struct kfifo *fifo)
 {
-    return fifo->in - fifo->out;
+    return atomic_load_explicit(&fifo->in, memory_order_acquire) -
+           atomic_load_explicit(&fifo->out, memory_order_acquire);
 }
 
 /* Check if fifo is empty */
 static inline int kfifo_is_empty(struct kfifo *fifo)
 {
-    return fifo->in == fifo->out;
+    return kfifo_len(fifo) == 0;
 }
 
 /* Check if fifo is full */
@@ -140,6 +691,337 @@ static inline int kfifo_is_full(struct kfifo *fifo)
     return kfifo_len(fifo) == fifo->size;
 }
 
+/*
+ * Bounded multi-producer/multi-consumer queue of fixed-size elements
+ * (Dmitry Vyukov's design). Each cell carries a sequence number that says
+ * whose turn it is: a producer at position pos owns the cell when
+ * seq == pos, a consumer when seq == pos + 1. Producers and consumers
+ * claim positions with a CAS on their own index and never touch each
+ * other's, so there is no shared lock. Sizing follows kfifo_alloc().
+ */
+struct kfifo_mpmc {
+    unsigned char *cells;
+    unsigned int size;          /* Number of cells, a power of 2 */
+    unsigned int mask;
+    unsigned int elem_size;
+    unsigned int stride;        /* Bytes per cell: sequence plus element */
+
+    atomic_uint enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    atomic_uint dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    /* Sleepers in the blocking calls, woken by the opposite side */
+    atomic_uint put_waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+    atomic_uint get_waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+};
+
+#define MPMC_SPIN 64
+
+static inline atomic_uint *mpmc_seq(struct kfifo_mpmc *q, unsigned int pos)
+{
+    return (atomic_uint *)(q->cells + (size_t)(pos & q->mask) * q->stride);
+}
+
+static inline void *mpmc_data(atomic_uint *seq)
+{
+    return (unsigned char *)seq + sizeof(*seq);
+}
+
+/* Allocate a queue of at least size elements of elem_size bytes */
+struct kfifo_mpmc *kfifo_mpmc_alloc(unsigned int size, unsigned int elem_size)
+{
+    struct kfifo_mpmc *q;
+    unsigned int i;
+
+    if (size < 2 || !elem_size)
+        return NULL;
+    size = roundup_pow_of_two(size);
+
+    q = aligned_alloc(CACHE_LINE_SIZE, sizeof(*q));
+    if (!q)
+        return NULL;
+
+    q->size = size;
+    q->mask = size - 1;
+    q->elem_size = elem_size;
+    q->stride = (sizeof(atomic_uint) + elem_size + 7) & ~7U;
+    q->cells = malloc((size_t)size * q->stride);
+    if (!q->cells) {
+        free(q);
+        return NULL;
+    }
+
+    for (i = 0; i < size; i++)
+        atomic_init(mpmc_seq(q, i), i);
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    atomic_init(&q->put_waiters, 0);
+    atomic_init(&q->get_waiters, 0);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    return q;
+}
+
+void kfifo_mpmc_free(struct kfifo_mpmc *q)
+{
+    if (q) {
+        pthread_cond_destroy(&q->not_empty);
+        pthread_cond_destroy(&q->not_full);
+        pthread_mutex_destroy(&q->lock);
+        free(q->cells);
+        free(q);
+    }
+}
+
+/* Wake sleepers of one side after the other side made progress */
+static void mpmc_wake(struct kfifo_mpmc *q, atomic_uint *waiters,
+                      pthread_cond_t *cond)
+{
+    /* Pairs with the fence taken by a sleeper after raising its count */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/* Claim and fill the next cell; returns 0 if the queue is full */
+static unsigned int __kfifo_mpmc_put(struct kfifo_mpmc *q, const void *elem)
+{
+    unsigned int pos, seq;
+    atomic_uint *cell;
+    int diff;
+
+    pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = mpmc_seq(q, pos);
+        seq = atomic_load_explicit(cell, memory_order_acquire);
+        diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;           /* The cell still holds last lap's element */
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(mpmc_data(cell), elem, q->elem_size);
+    atomic_store_explicit(cell, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* Claim and drain the next cell; returns 0 if the queue is empty */
+static unsigned int __kfifo_mpmc_get(struct kfifo_mpmc *q, void *elem)
+{
+    unsigned int pos, seq;
+    atomic_uint *cell;
+    int diff;
+
+    pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = mpmc_seq(q, pos);
+        seq = atomic_load_explicit(cell, memory_order_acquire);
+        diff = (int)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;           /* Not yet filled on this lap */
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(elem, mpmc_data(cell), q->elem_size);
+    /* Hand the cell to the producer one lap ahead */
+    atomic_store_explicit(cell, pos + q->size, memory_order_release);
+    return 1;
+}
+
+/* Enqueue one element; returns 1, or 0 if the queue is full */
+unsigned int kfifo_mpmc_try_put(struct kfifo_mpmc *q, const void *elem)
+{
+    if (!__kfifo_mpmc_put(q, elem))
+        return 0;
+    mpmc_wake(q, &q->get_waiters, &q->not_empty);
+    return 1;
+}
+
+/* Dequeue one element; returns 1, or 0 if the queue is empty */
+unsigned int kfifo_mpmc_try_get(struct kfifo_mpmc *q, void *elem)
+{
+    if (!__kfifo_mpmc_get(q, elem))
+        return 0;
+    mpmc_wake(q, &q->put_waiters, &q->not_full);
+    return 1;
+}
+
+/* Enqueue one element, sleeping while the queue is full */
+void kfifo_mpmc_put(struct kfifo_mpmc *q, const void *elem)
+{
+    int i;
+
+    for (i = 0; i < MPMC_SPIN; i++) {
+        if (kfifo_mpmc_try_put(q, elem))
+            return;
+        sched_yield();
+    }
+
+    /*
+     * The waiter count is raised before the final retry, so a consumer
+     * freeing a cell either sees us and broadcasts under the lock, or
+     * we see its cell
+     */
+    pthread_mutex_lock(&q->lock);
+    atomic_fetch_add_explicit(&q->put_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!__kfifo_mpmc_put(q, elem))
+        pthread_cond_wait(&q->not_full, &q->lock);
+    atomic_fetch_sub_explicit(&q->put_waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+
+    mpmc_wake(q, &q->get_waiters, &q->not_empty);
+}
+
+/* Dequeue one element, sleeping while the queue is empty */
+void kfifo_mpmc_get(struct kfifo_mpmc *q, void *elem)
+{
+    int i;
+
+    for (i = 0; i < MPMC_SPIN; i++) {
+        if (kfifo_mpmc_try_get(q, elem))
+            return;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&q->lock);
+    atomic_fetch_add_explicit(&q->get_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!__kfifo_mpmc_get(q, elem))
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    atomic_fetch_sub_explicit(&q->get_waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+
+    mpmc_wake(q, &q->put_waiters, &q->not_full);
+}
+
+/*
+ * Typed fifo of size elements of type, generated at compile time:
+ * DECLARE_KFIFO(name, type, size) defines struct name and name_init(),
+ * name_put()/name_get() for one element and name_put_bulk()/
+ * name_get_bulk() for arrays. Indices count elements and size is a
+ * constant power of two, so the compiler sees fixed-size copies and a
+ * constant mask. Concurrency rules are those of struct kfifo: one
+ * producer and one consumer.
+ */
+#define DECLARE_KFIFO(name, type, size)                                     \
+_Static_assert((size) > 0 && ((size) & ((size) - 1)) == 0,                  \
+               #name " size must be a power of 2");                        \
+struct name {                                                               \
+    atomic_uint in __attribute__((aligned(CACHE_LINE_SIZE)));              \
+    unsigned int out_cache;                                                 \
+    atomic_uint out __attribute__((aligned(CACHE_LINE_SIZE)));             \
+    unsigned int in_cache;                                                  \
+    type buf[size] __attribute__((aligned(CACHE_LINE_SIZE)));              \
+};                                                                          \
+                                                                            \
+static inline void name##_init(struct name *fifo)                           \
+{                                                                           \
+    atomic_init(&fifo->in, 0);                                              \
+    atomic_init(&fifo->out, 0);                                             \
+    fifo->out_cache = 0;                                                    \
+    fifo->in_cache = 0;                                                     \
+}                                                                           \
+                                                                            \
+static inline unsigned int name##_len(struct name *fifo)                    \
+{                                                                           \
+    return atomic_load_explicit(&fifo->in, memory_order_acquire) -          \
+           atomic_load_explicit(&fifo->out, memory_order_acquire);          \
+}                                                                           \
+                                                                            \
+static inline unsigned int name##_put_bulk(struct name *fifo,               \
+                                           const type *v, unsigned int n)   \
+{                                                                           \
+    unsigned int in, avail, off, l;                                         \
+                                                                            \
+    in = atomic_load_explicit(&fifo->in, memory_order_relaxed);             \
+    avail = (size) - (in - fifo->out_cache);                                \
+    if (avail < n) {                                                        \
+        fifo->out_cache = atomic_load_explicit(&fifo->out,                  \
+                                               memory_order_acquire);       \
+        avail = (size) - (in - fifo->out_cache);                            \
+    }                                                                       \
+    n = min(n, avail);                                                      \
+                                                                            \
+    off = in & ((size) - 1);                                                \
+    l = min(n, (size) - off);                                               \
+    memcpy(fifo->buf + off, v, l * sizeof(type));                           \
+    memcpy(fifo->buf, v + l, (n - l) * sizeof(type));                       \
+    atomic_store_explicit(&fifo->in, in + n, memory_order_release);         \
+    return n;                                                               \
+}                                                                           \
+                                                                            \
+static inline unsigned int name##_get_bulk(struct name *fifo, type *v,      \
+                                           unsigned int n)                  \
+{                                                                           \
+    unsigned int out, avail, off, l;                                        \
+                                                                            \
+    out = atomic_load_explicit(&fifo->out, memory_order_relaxed);           \
+    avail = fifo->in_cache - out;                                           \
+    if (avail < n) {                                                        \
+        fifo->in_cache = atomic_load_explicit(&fifo->in,                    \
+                                              memory_order_acquire);        \
+        avail = fifo->in_cache - out;                                       \
+    }                                                                       \
+    n = min(n, avail);                                                      \
+                                                                            \
+    off = out & ((size) - 1);                                               \
+    l = min(n, (size) - off);                                               \
+    memcpy(v, fifo->buf + off, l * sizeof(type));                           \
+    memcpy(v + l, fifo->buf, (n - l) * sizeof(type));                       \
+    atomic_store_explicit(&fifo->out, out + n, memory_order_release);       \
+    return n;                                                               \
+}                                                                           \
+                                                                            \
+static inline int name##_put(struct name *fifo, const type *v)              \
+{                                                                           \
+    unsigned int in = atomic_load_explicit(&fifo->in, memory_order_relaxed);\
+                                                                            \
+    if (in - fifo->out_cache == (size)) {                                   \
+        fifo->out_cache = atomic_load_explicit(&fifo->out,                  \
+                                               memory_order_acquire);       \
+        if (in - fifo->out_cache == (size))                                 \
+            return 0;                                                       \
+    }                                                                       \
+    fifo->buf[in & ((size) - 1)] = *v;                                      \
+    atomic_store_explicit(&fifo->in, in + 1, memory_order_release);         \
+    return 1;                                                               \
+}                                                                           \
+                                                                            \
+static inline int name##_get(struct name *fifo, type *v)                    \
+{                                                                           \
+    unsigned int out = atomic_load_explicit(&fifo->out,                     \
+                                            memory_order_relaxed);          \
+                                                                            \
+    if (fifo->in_cache == out) {                                            \
+        fifo->in_cache = atomic_load_explicit(&fifo->in,                    \
+                                              memory_order_acquire);        \
+        if (fifo->in_cache == out)                                          \
+            return 0;                                                       \
+    }                                                                       \
+    *v = fifo->buf[out & ((size) - 1)];                                     \
+    atomic_store_explicit(&fifo->out, out + 1, memory_order_release);       \
+    return 1;                                                               \
+}
+
 /* Test functions */
 void print_fifo_status(struct kfifo *fifo)
 {
@@ -149,7 +1031,7 @@ void print_fifo_status(struct kfifo *fifo)
     printf("  Free: %u\n", fifo->size - kfifo_len(fifo));
     printf("  Empty: %s\n", kfifo_is_empty(fifo) ? "yes" : "no");
     printf("  Full: %s\n", kfifo_is_full(fifo) ? "yes" : "no");
-    printf("  In: %u, Out: %u\n", fifo->in, fifo->out);
+    printf("  In: %u, Out: %u\n", atomic_load(&fifo->in), atomic_load(&fifo->out));
 }
 
 void print_buffer(const char *label, unsigned char *buffer, unsigned int len)
@@ -161,6 +1043,210 @@ void print_buffer(const char *label, unsigned char *buffer, unsigned int len)
     printf("\n");
 }
 
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* SPSC benchmark: the producer sends a counter, the consumer checks it */
+#define SPSC_ITEMS 10000000UL
+
+struct spsc_args {
+    struct kfifo *fifo;
+    unsigned long errors;
+};
+
+void *spsc_producer(void *arg)
+{
+    struct spsc_args *args = arg;
+    uint64_t seq;
+
+    for (seq = 0; seq < SPSC_ITEMS; seq++) {
+        while (kfifo_in(args->fifo, (unsigned char *)&seq, sizeof(seq)) == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+void *spsc_consumer(void *arg)
+{
+    struct spsc_args *args = arg;
+    uint64_t seq, expect;
+
+    for (expect = 0; expect < SPSC_ITEMS; expect++) {
+        while (kfifo_out(args->fifo, (unsigned char *)&seq, sizeof(seq)) == 0)
+            sched_yield();
+        if (seq != expect)
+            args->errors++;
+    }
+    return NULL;
+}
+
+/* Blocking SPSC benchmark: one item per put, bulk gets of up to 64 items */
+#define WAIT_ITEMS 1000000UL
+
+void *wait_producer(void *arg)
+{
+    struct spsc_args *args = arg;
+    uint64_t seq;
+
+    for (seq = 0; seq < WAIT_ITEMS; seq++)
+        kfifo_in_wait(args->fifo, (unsigned char *)&seq, sizeof(seq));
+    kfifo_in_flush(args->fifo);
+    return NULL;
+}
+
+void *wait_consumer(void *arg)
+{
+    struct spsc_args *args = arg;
+    uint64_t batch[64], expect = 0;
+    unsigned int got = 0, ret, i;
+
+    while (expect < WAIT_ITEMS) {
+        ret = kfifo_out_wait(args->fifo, (unsigned char *)batch + got,
+                             sizeof(batch) - got);
+        got += ret;
+        for (i = 0; i < got / sizeof(uint64_t); i++, expect++)
+            if (batch[i] != expect)
+                args->errors++;
+        /* Keep a partial item for the next round */
+        memmove(batch, (unsigned char *)batch + i * sizeof(uint64_t),
+                got % sizeof(uint64_t));
+        got %= sizeof(uint64_t);
+    }
+    return NULL;
+}
+
+/*
+ * Typed fifo benchmark: 16-byte descriptors through a 256-entry typed
+ * fifo, one at a time and in bursts, against the same traffic through a
+ * 4 KB byte fifo
+ */
+#define DESC_ITEMS 4000000UL
+#define DESC_BURST 32
+
+struct desc {
+    uint64_t seq;
+    uint64_t cookie;
+};
+
+DECLARE_KFIFO(desc_fifo, struct desc, 256)
+
+struct desc_args {
+    struct desc_fifo *typed;
+    struct kfifo *bytes;
+    int bulk;
+    unsigned long errors;
+};
+
+void *desc_producer(void *arg)
+{
+    struct desc_args *args = arg;
+    struct desc d[DESC_BURST];
+    unsigned long seq = 0;
+    unsigned int n, i;
+
+    while (seq < DESC_ITEMS) {
+        n = args->bulk ? DESC_BURST : 1;
+        for (i = 0; i < n; i++)
+            d[i] = (struct desc){ seq + i, ~(seq + i) };
+
+        if (args->bytes) {
+            unsigned int done = 0;
+
+            while (done < n * sizeof(d[0])) {
+                done += kfifo_in(args->bytes, (unsigned char *)d + done,
+                                 n * sizeof(d[0]) - done);
+                if (done < n * sizeof(d[0]))
+                    sched_yield();
+            }
+        } else if (args->bulk) {
+            for (i = 0; i < n; ) {
+                i += desc_fifo_put_bulk(args->typed, d + i, n - i);
+                if (i < n)
+                    sched_yield();
+            }
+        } else {
+            while (!desc_fifo_put(args->typed, &d[0]))
+                sched_yield();
+        }
+        seq += n;
+    }
+    return NULL;
+}
+
+void *desc_consumer(void *arg)
+{
+    struct desc_args *args = arg;
+    struct desc d[DESC_BURST];
+    unsigned long seq = 0;
+    unsigned int n, i;
+
+    while (seq < DESC_ITEMS) {
+        if (args->bytes) {
+            /* Byte fifos need length math to stay on element boundaries */
+            n = kfifo_out(args->bytes, (unsigned char *)d,
+                          (args->bulk ? DESC_BURST : 1) * sizeof(d[0]));
+            while (n % sizeof(d[0]))
+                n += kfifo_out(args->bytes, (unsigned char *)d + n,
+                               sizeof(d[0]) - n % sizeof(d[0]));
+            n /= sizeof(d[0]);
+        } else if (args->bulk) {
+            n = desc_fifo_get_bulk(args->typed, d, DESC_BURST);
+        } else {
+            n = desc_fifo_get(args->typed, &d[0]);
+        }
+        if (!n) {
+            sched_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++, seq++)
+            if (d[i].seq != seq || d[i].cookie != ~seq)
+                args->errors++;
+    }
+    return NULL;
+}
+
+/*
+ * MPMC benchmark: producers send disjoint ranges of values, consumers
+ * count and sum what they receive so losses or duplicates show up
+ */
+#define MPMC_ITEMS (1UL << 20)
+#define MPMC_MAX_THREADS 32
+
+struct mpmc_args {
+    struct kfifo_mpmc *q;
+    uint64_t first;
+    unsigned long nr;
+    uint64_t sum;
+};
+
+void *mpmc_producer(void *arg)
+{
+    struct mpmc_args *args = arg;
+    uint64_t v;
+
+    for (v = args->first; v < args->first + args->nr; v++)
+        kfifo_mpmc_put(args->q, &v);
+    return NULL;
+}
+
+void *mpmc_consumer(void *arg)
+{
+    struct mpmc_args *args = arg;
+    unsigned long i;
+    uint64_t v;
+
+    for (i = 0; i < args->nr; i++) {
+        kfifo_mpmc_get(args->q, &v);
+        args->sum += v;
+    }
+    return NULL;
+}
+
 int main()
 {
     struct kfifo *fifo;
@@ -235,7 +1321,373 @@ int main()
     /* Clean up */
     printf("7. Cleaning up...\n");
     kfifo_free(fifo);
-    printf("FIFO freed\n");
+    printf("FIFO freed\n\n");
+
+    /* Producer and consumer threads sharing one fifo */
+    printf("8. SPSC throughput (%lu 8-byte items, 4 KB fifo)...\n", SPSC_ITEMS);
+    {
+        struct spsc_args args = { .errors = 0 };
+        pthread_t producer, consumer;
+        double start, elapsed;
+
+        args.fifo = kfifo_alloc(4096);
+        if (!args.fifo) {
+            printf("Failed to allocate FIFO!\n");
+            return -1;
+        }
+
+        start = now_sec();
+        pthread_create(&consumer, NULL, spsc_consumer, &args);
+        pthread_create(&producer, NULL, spsc_producer, &args);
+        pthread_join(producer, NULL);
+        pthread_join(consumer, NULL);
+        elapsed = now_sec() - start;
+
+        printf("%.1f Mops/s, %lu sequence errors\n",
+               SPSC_ITEMS / elapsed / 1e6, args.errors);
+        print_fifo_status(args.fifo);
+        kfifo_free(args.fifo);
+    }
+
+    /* Bounded MPMC queue with equal numbers of producers and consumers */
+    printf("\n9. MPMC throughput (%lu 8-byte items, 1024 slots)...\n", MPMC_ITEMS);
+    {
+        struct mpmc_args prod[MPMC_MAX_THREADS], cons[MPMC_MAX_THREADS];
+        pthread_t ptid[MPMC_MAX_THREADS], ctid[MPMC_MAX_THREADS];
+        const uint64_t expect = (uint64_t)MPMC_ITEMS * (MPMC_ITEMS - 1) / 2;
+        struct kfifo_mpmc *q;
+        double start, elapsed;
+        uint64_t sum;
+        int nr, i;
+
+        q = kfifo_mpmc_alloc(1000, sizeof(uint64_t));
+        if (!q) {
+            printf("Failed to allocate MPMC queue!\n");
+            return -1;
+        }
+        printf("Queue: %u slots of %u bytes (%u byte cells)\n",
+               q->size, q->elem_size, q->stride);
+
+        for (nr = 1; nr <= MPMC_MAX_THREADS; nr *= 2) {
+            unsigned long per = MPMC_ITEMS / nr;
+
+            start = now_sec();
+            for (i = 0; i < nr; i++) {
+                prod[i] = (struct mpmc_args){ q, (uint64_t)i * per, per, 0 };
+                cons[i] = (struct mpmc_args){ q, 0, per, 0 };
+                pthread_create(&ctid[i], NULL, mpmc_consumer, &cons[i]);
+                pthread_create(&ptid[i], NULL, mpmc_producer, &prod[i]);
+            }
+            sum = 0;
+            for (i = 0; i < nr; i++) {
+                pthread_join(ptid[i], NULL);
+                pthread_join(ctid[i], NULL);
+                sum += cons[i].sum;
+            }
+            elapsed = now_sec() - start;
+
+            printf("%2dP/%2dC: %6.2f Mops/s, checksum %s\n", nr, nr,
+                   MPMC_ITEMS / elapsed / 1e6, sum == expect ? "ok" : "BAD");
+        }
+        kfifo_mpmc_free(q);
+    }
+
+    /* Variable-length records with length headers */
+    printf("\n10. Testing record mode...\n");
+    {
+        const char *msgs[] = { "alpha", "be", "gamma-delta", "0123456789ab" };
+        unsigned char big[300];
+
+        fifo = kfifo_alloc(32);
+        if (!fifo) {
+            printf("Failed to allocate FIFO!\n");
+            return -1;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            ret = kfifo_in_rec(fifo, (const unsigned char *)msgs[i],
+                               strlen(msgs[i]), 1);
+            printf("Record \"%s\" (%zu+1 bytes): %s, used %u\n", msgs[i],
+                   strlen(msgs[i]), ret ? "queued" : "rejected", kfifo_len(fifo));
+        }
+
+        printf("Next record length: %u\n", kfifo_peek_len(fifo, 1));
+        memset(buffer, 0, sizeof(buffer));
+        ret = kfifo_out_rec(fifo, buffer, sizeof(buffer), 1);
+        print_buffer("Record", buffer, ret);
+
+        printf("Skipping record of %u bytes\n", kfifo_peek_len(fifo, 1));
+        kfifo_skip_rec(fifo, 1);
+
+        memset(buffer, 0, sizeof(buffer));
+        ret = kfifo_out_rec(fifo, buffer, 4, 1);
+        print_buffer("Truncated record", buffer, ret);
+        printf("Empty after three records: %s\n", kfifo_is_empty(fifo) ? "yes" : "no");
+        kfifo_free(fifo);
+
+        /* Records over 255 bytes need a 2-byte header */
+        fifo = kfifo_alloc(512);
+        if (!fifo) {
+            printf("Failed to allocate FIFO!\n");
+            return -1;
+        }
+        for (unsigned int i = 0; i < sizeof(big); i++)
+            big[i] = i & 0xff;
+        printf("300-byte record, 1-byte header: %s\n",
+               kfifo_in_rec(fifo, big, sizeof(big), 1) ? "queued" : "rejected");
+        printf("300-byte record, 2-byte header: %s\n",
+               kfifo_in_rec(fifo, big, sizeof(big), 2) ? "queued" : "rejected");
+        printf("Next record length: %u\n", kfifo_peek_len(fifo, 2));
+        {
+            unsigned char copy[300];
+
+            ret = kfifo_out_rec(fifo, copy, sizeof(copy), 2);
+            printf("Read %u bytes, data %s\n", ret,
+                   ret == sizeof(big) && !memcmp(copy, big, ret) ? "matches" : "differs");
+        }
+        kfifo_free(fifo);
+    }
+
+    /* Producer and consumer working in the ring without staging copies */
+    printf("\n11. Testing zero-copy access...\n");
+    {
+        struct kfifo *dst;
+        struct iovec iov[2];
+        unsigned int n, sum;
+        int fds[2];
+
+        fifo = kfifo_alloc(16);
+        dst = kfifo_alloc(16);
+        if (!fifo || !dst || pipe(fds) < 0) {
+            printf("Failed to set up zero-copy test!\n");
+            return -1;
+        }
+
+        /* Move the indices so the next reservation wraps */
+        kfifo_in(fifo, (const unsigned char *)"0123456789", 10);
+        kfifo_out(fifo, buffer, 10);
+
+        n = kfifo_prepare_in(fifo, 12, iov);
+        printf("Prepared %u bytes in %zu + %zu byte regions\n",
+               n, iov[0].iov_len, iov[1].iov_len);
+        for (unsigned int i = 0, k = 0; k < 2; k++)
+            for (size_t j = 0; j < iov[k].iov_len; j++, i++)
+                ((unsigned char *)iov[k].iov_base)[j] = 'a' + i;
+        kfifo_commit_in(fifo, n);
+        print_fifo_status(fifo);
+
+        /* Parse in place: sum the letters without copying them out */
+        n = kfifo_peek_out(fifo, 5, iov);
+        sum = 0;
+        for (int k = 0; k < 2; k++)
+            for (size_t j = 0; j < iov[k].iov_len; j++)
+                sum += ((unsigned char *)iov[k].iov_base)[j] - 'a';
+        printf("Peeked %u bytes, letter sum %u, used still %u\n",
+               n, sum, kfifo_len(fifo));
+        kfifo_consume_out(fifo, n);
+
+        /* fifo -> pipe -> dst, both ends wrapping */
+        kfifo_in(dst, (const unsigned char *)"0123456789", 10);
+        kfifo_out(dst, buffer, 10);
+        printf("Wrote %zd bytes to pipe\n", kfifo_to_fd(fifo, fds[1], 16));
+        printf("Read %zd bytes from pipe\n", kfifo_from_fd(dst, fds[0], 16));
+        memset(buffer, 0, sizeof(buffer));
+        ret = kfifo_out(dst, buffer, sizeof(buffer));
+        print_buffer("Retrieved data", buffer, ret);
+
+        close(fds[0]);
+        close(fds[1]);
+        kfifo_free(dst);
+        kfifo_free(fifo);
+    }
+
+    /* Same pages mapped twice so wrapped regions stay contiguous */
+    printf("\n12. Testing mirrored buffer...\n");
+    {
+        const char *line = "key=value;next=item;";
+        struct iovec iov[2];
+        char *p, *end;
+        unsigned int n;
+
+        fifo = kfifo_alloc_mirrored(100);
+        if (!fifo) {
+            printf("Failed to allocate mirrored FIFO!\n");
+            return -1;
+        }
+        printf("Mirrored FIFO of %u bytes\n", fifo->size);
+
+        /* Leave the indices 8 bytes short of the end of the buffer */
+        for (n = fifo->size - 8; n; n -= ret) {
+            ret = kfifo_in(fifo, (const unsigned char *)test_data[0], min(n, 5));
+            kfifo_out(fifo, buffer, ret);
+        }
+
+        ret = kfifo_in(fifo, (const unsigned char *)line, strlen(line));
+        n = kfifo_peek_out(fifo, ret, iov);
+        printf("Queued %u bytes across the wrap, peek gives %zu + %zu bytes\n",
+               n, iov[0].iov_len, iov[1].iov_len);
+        printf("Wrapped tail visible at buffer start: %s\n",
+               !memcmp(fifo->buffer, line + 8, strlen(line) - 8) ? "yes" : "no");
+
+        /* Parse fields through one pointer, straight across the wrap */
+        p = iov[0].iov_base;
+        end = p + n;
+        while (p < end) {
+            char *semi = memchr(p, ';', end - p);
+
+            if (!semi)
+                break;
+            printf("Field: %.*s\n", (int)(semi - p), p);
+            p = semi + 1;
+        }
+        kfifo_consume_out(fifo, n);
+        print_fifo_status(fifo);
+        kfifo_free(fifo);
+    }
+
+    /* Futex sleeps with wakeups batched by threshold */
+    printf("\n13. Blocking waits (%lu 8-byte items, 4 KB fifo)...\n", WAIT_ITEMS);
+    {
+        unsigned int thresholds[] = { 1, 64, 512, 2048 };
+
+        for (int t = 0; t < 4; t++) {
+            struct spsc_args args = { .errors = 0 };
+            pthread_t producer, consumer;
+            double start, elapsed;
+
+            args.fifo = kfifo_alloc(4096);
+            if (!args.fifo) {
+                printf("Failed to allocate FIFO!\n");
+                return -1;
+            }
+            kfifo_set_wake_threshold(args.fifo, thresholds[t]);
+
+            start = now_sec();
+            pthread_create(&consumer, NULL, wait_consumer, &args);
+            pthread_create(&producer, NULL, wait_producer, &args);
+            pthread_join(producer, NULL);
+            pthread_join(consumer, NULL);
+            elapsed = now_sec() - start;
+
+            printf("Threshold %4u: %6.2f Mops/s, %lu wakeups, %lu sequence errors\n",
+                   thresholds[t], WAIT_ITEMS / elapsed / 1e6,
+                   atomic_load(&args.fifo->nr_wakeups), args.errors);
+            kfifo_free(args.fifo);
+        }
+    }
+
+    /* Producer in a child process, collector here, ring in shared memory */
+    printf("\n14. Cross-process shared FIFO (%lu 8-byte items, 4 KB fifo)...\n",
+           WAIT_ITEMS);
+    {
+        char name[64];
+        uint64_t seq, expect;
+        unsigned long errors = 0;
+        double start, elapsed;
+        int status, attach[2];
+        char attached = 0;
+        pid_t pid;
+
+        snprintf(name, sizeof(name), "/kfifo-test-%d", (int)getpid());
+        fifo = kfifo_create_shared(name, 4096);
+        if (!fifo) {
+            printf("Failed to create shared FIFO!\n");
+            return -1;
+        }
+        kfifo_set_wake_threshold(fifo, 512);
+        if (pipe(attach) != 0) {
+            printf("Failed to create attach pipe!\n");
+            kfifo_free(fifo);
+            shm_unlink(name);
+            return -1;
+        }
+
+        start = now_sec();
+        pid = fork();
+        if (pid < 0) {
+            printf("Failed to fork producer!\n");
+            kfifo_free(fifo);
+            shm_unlink(name);
+            return -1;
+        }
+        if (pid == 0) {
+            struct kfifo *peer = kfifo_attach_shared(name);
+
+            /* Tell the parent whether to expect any records */
+            attached = peer != NULL;
+            close(attach[0]);
+            if (write(attach[1], &attached, 1) != 1 || !peer)
+                _exit(1);
+            close(attach[1]);
+            for (seq = 0; seq < WAIT_ITEMS; seq++)
+                kfifo_in_wait(peer, (unsigned char *)&seq, sizeof(seq));
+            kfifo_in_flush(peer);
+            kfifo_free(peer);
+            _exit(0);
+        }
+
+        /* A child that died before attaching closes the pipe unanswered */
+        close(attach[1]);
+        if (read(attach[0], &attached, 1) != 1)
+            attached = 0;
+        close(attach[0]);
+
+        for (expect = 0; attached && expect < WAIT_ITEMS; expect++) {
+            kfifo_out_wait(fifo, (unsigned char *)&seq, sizeof(seq));
+            if (seq != expect)
+                errors++;
+        }
+        waitpid(pid, &status, 0);
+        elapsed = now_sec() - start;
+
+        if (attached)
+            printf("Child exit %d, %.2f Mops/s, %lu wakeups, %lu sequence errors\n",
+                   WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                   WAIT_ITEMS / elapsed / 1e6, atomic_load(&fifo->nr_wakeups),
+                   errors);
+        else
+            printf("Child failed to attach to the shared FIFO (exit %d)\n",
+                   WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        kfifo_free(fifo);
+        shm_unlink(name);
+    }
+
+    /* Compile-time typed fifo against the byte fifo */
+    printf("\n15. Typed FIFO (%lu 16-byte descriptors, 256 entries / 4 KB)...\n",
+           DESC_ITEMS);
+    {
+        static struct desc_fifo typed;
+        const char *modes[] = { "byte, single", "byte, bulk",
+                                "typed, single", "typed, bulk" };
+
+        for (int m = 0; m < 4; m++) {
+            struct desc_args args = { .bulk = m & 1, .errors = 0 };
+            pthread_t producer, consumer;
+            double start, elapsed;
+
+            if (m < 2) {
+                args.bytes = kfifo_alloc(256 * sizeof(struct desc));
+                if (!args.bytes) {
+                    printf("Failed to allocate FIFO!\n");
+                    return -1;
+                }
+            } else {
+                desc_fifo_init(&typed);
+                args.typed = &typed;
+            }
+
+            start = now_sec();
+            pthread_create(&consumer, NULL, desc_consumer, &args);
+            pthread_create(&producer, NULL, desc_producer, &args);
+            pthread_join(producer, NULL);
+            pthread_join(consumer, NULL);
+            elapsed = now_sec() - start;
+
+            printf("%-13s: %6.2f Mdesc/s, %lu errors\n", modes[m],
+                   DESC_ITEMS / elapsed / 1e6, args.errors);
+            kfifo_free(args.bytes);
+        }
+    }
 
     return 0;
 }
@@ -1,192 +1,2186 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 /* Constants */
 #define MEMPOOL_INIT_SIZE  4
 #define MEMPOOL_MAX_SIZE   16
 #define TEST_ELEM_SIZE     64
+#define MEMPOOL_MAG_SIZE   16   /* Default rounds per magazine */
+#define MEMPOOL_MAG_MAX    64   /* Largest supported magazine */
+#define SLAB_PAGE_SIZE     4096
+#define SLAB_MIN_OBJS      8    /* Grow slabs until this many objects fit */
+#define SLAB_COLOUR_ALIGN  64   /* Colour step, one cache line */
+#define HPAGE_SIZE         (2UL << 20)
+#define MAX_NUMNODES       64
+#define MPOL_BIND          2
+#define ARENA_HUGETLB      (1 << 0) /* Try MAP_HUGETLB before THP */
+#define BENCH_OPS          (1UL << 20)
+#define BENCH_SLAB_OBJS    (1UL << 16)
+#define BENCH_MAX_THREADS  64
+#define BENCH_LAT_SAMPLES  20000 /* Latency samples per thread */
+#define BENCH_LAT_OVERSUB  4     /* Threads per online CPU */
+#define BENCH_ARENA_OBJS   (1UL << 19)
 
 /* Structure definitions */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+typedef void *(mempool_alloc_t)(size_t size, void *pool_data);
+typedef void (mempool_free_t)(void *element, void *pool_data);
+typedef size_t (mempool_alloc_bulk_t)(size_t size, size_t nr, void **ptrs,
+                                      void *pool_data);
+typedef void (mempool_free_bulk_t)(void **ptrs, size_t nr, void *pool_data);
+
 struct mempool_element {
     void *ptr;
     struct mempool_element *next;
 };
 
-struct mempool {
-    size_t min_nr;           /* Minimum number of elements */
-    size_t curr_nr;          /* Current number of elements */
-    size_t elem_size;        /* Size of each element */
-    pthread_mutex_t lock;    /* Pool lock */
-    struct mempool_element *elements; /* Free elements list */
-    void *(*alloc)(size_t); /* Allocation function */
-    void (*free)(void *);   /* Free function */
+/* A thread sleeping in mempool_alloc_wait() */
+struct mempool_waiter {
+    struct mempool_waiter *next;
+    pthread_cond_t cond;
+    void *ptr;               /* Element handed over by mempool_free() */
+};
+
+/* Usage and contention counters, protected by pool->lock */
+struct mempool_stats {
+    unsigned long alloc_backing;  /* Served by the backing allocator */
+    unsigned long alloc_reserve;  /* Served from the reserve or a free */
+    unsigned long alloc_failed;   /* Returned NULL */
+    unsigned long alloc_waited;   /* Slept in mempool_alloc_wait() */
+    unsigned long free_reserve;   /* Refilled the reserve or fed a waiter */
+    unsigned long free_backing;   /* Returned to the backing allocator */
+    size_t reserve_low;           /* Lowest curr_nr seen */
+    size_t total_high;            /* High-water mark of total_nr */
+    unsigned long lock_acquires;
+    unsigned long lock_contended; /* Acquisitions where trylock failed */
+    uint64_t lock_wait_ns;        /* Time blocked after a failed trylock */
+    uint64_t lock_wait_max_ns;
+};
+
+/* Point-in-time copy of a pool's state and counters */
+struct mempool_snapshot {
+    size_t min_nr;
+    size_t curr_nr;
+    size_t total_nr;
+    size_t max_nr;
+    struct mempool_stats stats;
+};
+
+struct mempool_depot;
+
+struct mempool {
+    size_t min_nr;           /* Minimum number of elements */
+    size_t curr_nr;          /* Current number of elements */
+    size_t total_nr;         /* Elements in reserve plus in use */
+    size_t max_nr;           /* Maximum value of total_nr */
+    size_t elem_size;        /* Size of each element */
+    pthread_mutex_t lock;    /* Pool lock */
+    struct mempool_element *elements; /* Free elements list */
+    struct mempool_element *spare;    /* Unused list nodes */
+    struct mempool_waiter *wait_head; /* FIFO of blocked allocators */
+    struct mempool_waiter *wait_tail;
+    mempool_alloc_t *alloc;  /* Allocation function */
+    mempool_free_t *free;    /* Free function */
+    mempool_alloc_bulk_t *alloc_bulk; /* Optional batched alloc */
+    mempool_free_bulk_t *free_bulk;   /* Optional batched free */
+    void *pool_data;         /* Argument to alloc/free */
+    struct mempool_depot *depot; /* Magazine depot, NULL if disabled */
+    struct mempool_stats stats;
+};
+
+/*
+ * Magazine layer (Bonwick & Adams, "Magazines and Vmem").
+ *
+ * Each thread keeps a loaded and a previous magazine per pool. Allocation
+ * and free only touch these two LIFO stacks; the depot lock is taken only
+ * to exchange a whole empty or full magazine, and the pool lock only when
+ * the depot has nothing to offer.
+ */
+struct mempool_magazine {
+    struct mempool_magazine *next;
+    size_t rounds;           /* Number of objects held */
+    void *objs[];            /* Object stack, depot->mag_size entries */
+};
+
+struct mempool_cpu_cache {
+    struct mempool *pool;
+    struct mempool_magazine *loaded;   /* Magazine in use */
+    struct mempool_magazine *previous; /* Either full or empty */
+};
+
+struct mempool_depot {
+    size_t mag_size;         /* Rounds per magazine */
+    pthread_mutex_t lock;    /* Depot lock */
+    pthread_key_t key;       /* Per-thread struct mempool_cpu_cache */
+    struct mempool_magazine *full;  /* Full magazines */
+    struct mempool_magazine *empty; /* Empty magazines */
+    size_t full_nr;
+    size_t empty_nr;
+    /* Statistics, protected by lock */
+    unsigned long full_gets;   /* Full magazines handed to a thread */
+    unsigned long full_puts;   /* Full magazines returned by a thread */
+    unsigned long empty_gets;  /* Empty magazines handed to a thread */
+    unsigned long empty_puts;  /* Empty magazines returned by a thread */
+    unsigned long mag_allocs;  /* Magazines created */
+    unsigned long pool_allocs; /* Allocations passed to the pool */
+    unsigned long pool_frees;  /* Frees passed to the pool */
+};
+
+/* List manipulation helpers */
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new,
+                            struct list_head *prev,
+                            struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next)
+{
+    next->prev = prev;
+    prev->next = next;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    __list_del(entry->prev, entry->next);
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline void list_move(struct list_head *entry, struct list_head *head)
+{
+    __list_del(entry->prev, entry->next);
+    list_add(entry, head);
+}
+
+static inline bool list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Helper functions */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *mempool_alloc_node(size_t size, void *pool_data)
+{
+    (void)pool_data;
+    return malloc(size);
+}
+
+static void mempool_free_node(void *ptr, void *pool_data)
+{
+    (void)pool_data;
+    free(ptr);
+}
+
+/* Initialize memory pool */
+static struct mempool *mempool_create(
+    size_t min_nr,
+    size_t elem_size,
+    mempool_alloc_t *alloc_fn,
+    mempool_free_t *free_fn,
+    void *pool_data)
+{
+    struct mempool *pool;
+    size_t i;
+
+    if (!min_nr || !elem_size)
+        return NULL;
+
+    pool = malloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->min_nr = min_nr;
+    pool->curr_nr = 0;
+    pool->total_nr = 0;
+    pool->max_nr = MEMPOOL_MAX_SIZE;
+    pool->elem_size = elem_size;
+    pool->elements = NULL;
+    pool->spare = NULL;
+    pool->wait_head = NULL;
+    pool->wait_tail = NULL;
+    pool->alloc = alloc_fn ? alloc_fn : mempool_alloc_node;
+    pool->free = free_fn ? free_fn : mempool_free_node;
+    pool->pool_data = pool_data;
+    pool->alloc_bulk = NULL;
+    pool->free_bulk = NULL;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->depot = NULL;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    /*
+     * Pre-allocate minimum number of elements. Their list nodes are never
+     * freed, so refilling the reserve in mempool_free() cannot fail.
+     */
+    for (i = 0; i < min_nr; i++) {
+        struct mempool_element *elem = malloc(sizeof(*elem));
+        if (!elem)
+            goto cleanup;
+
+        elem->ptr = pool->alloc(elem_size, pool->pool_data);
+        if (!elem->ptr) {
+            free(elem);
+            goto cleanup;
+        }
+
+        elem->next = pool->elements;
+        pool->elements = elem;
+        pool->curr_nr++;
+        pool->total_nr++;
+    }
+    pool->stats.reserve_low = pool->curr_nr;
+    pool->stats.total_high = pool->total_nr;
+
+    return pool;
+
+cleanup:
+    while (pool->elements) {
+        struct mempool_element *elem = pool->elements;
+        pool->elements = elem->next;
+        pool->free(elem->ptr, pool->pool_data);
+        free(elem);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return NULL;
+}
+
+/*
+ * Take pool->lock, timing the wait whenever it is contended. The
+ * uncontended path costs one trylock and no clock reads.
+ */
+static void mempool_lock(struct mempool *pool)
+{
+    uint64_t start, wait;
+
+    if (pthread_mutex_trylock(&pool->lock) == 0) {
+        pool->stats.lock_acquires++;
+        return;
+    }
+
+    start = now_ns();
+    pthread_mutex_lock(&pool->lock);
+    wait = now_ns() - start;
+
+    pool->stats.lock_acquires++;
+    pool->stats.lock_contended++;
+    pool->stats.lock_wait_ns += wait;
+    if (wait > pool->stats.lock_wait_max_ns)
+        pool->stats.lock_wait_max_ns = wait;
+}
+
+/*
+ * Allocate an element with pool->lock held. The backing allocator is tried
+ * first; the min_nr reserve is only tapped once it fails or max_nr is hit.
+ */
+static void *mempool_alloc_locked(struct mempool *pool)
+{
+    struct mempool_element *elem;
+    void *ptr = NULL;
+
+    if (pool->total_nr < pool->max_nr) {
+        ptr = pool->alloc(pool->elem_size, pool->pool_data);
+        if (ptr) {
+            pool->total_nr++;
+            if (pool->total_nr > pool->stats.total_high)
+                pool->stats.total_high = pool->total_nr;
+            pool->stats.alloc_backing++;
+            return ptr;
+        }
+    }
+
+    if (pool->elements) {
+        /* Get element from reserve */
+        elem = pool->elements;
+        pool->elements = elem->next;
+        ptr = elem->ptr;
+        elem->next = pool->spare;
+        pool->spare = elem;
+        pool->curr_nr--;
+        if (pool->curr_nr < pool->stats.reserve_low)
+            pool->stats.reserve_low = pool->curr_nr;
+        pool->stats.alloc_reserve++;
+    }
+
+    return ptr;
+}
+
+/* Allocate element from pool */
+static void *mempool_alloc(struct mempool *pool)
+{
+    void *ptr;
+
+    if (!pool)
+        return NULL;
+
+    mempool_lock(pool);
+    ptr = mempool_alloc_locked(pool);
+    if (!ptr)
+        pool->stats.alloc_failed++;
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+/* Remove a timed-out waiter from the wait queue */
+static void mempool_dequeue_waiter(struct mempool *pool, struct mempool_waiter *w)
+{
+    struct mempool_waiter **pp, *prev = NULL;
+
+    for (pp = &pool->wait_head; *pp; prev = *pp, pp = &(*pp)->next) {
+        if (*pp == w) {
+            *pp = w->next;
+            if (pool->wait_tail == w)
+                pool->wait_tail = prev;
+            return;
+        }
+    }
+}
+
+/*
+ * Allocate element, sleeping until one is freed if both the backing
+ * allocator and the reserve are exhausted. Waiters are served strictly in
+ * arrival order: mempool_free() hands its element to the oldest one.
+ * A negative timeout_ms waits forever, zero does not wait at all.
+ */
+static void *mempool_alloc_wait(struct mempool *pool, long timeout_ms)
+{
+    struct mempool_waiter w;
+    pthread_condattr_t attr;
+    struct timespec deadline;
+    void *ptr;
+
+    if (!pool)
+        return NULL;
+
+    mempool_lock(pool);
+    ptr = mempool_alloc_locked(pool);
+    if (ptr || timeout_ms == 0) {
+        if (!ptr)
+            pool->stats.alloc_failed++;
+        pthread_mutex_unlock(&pool->lock);
+        return ptr;
+    }
+    pool->stats.alloc_waited++;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    w.next = NULL;
+    w.ptr = NULL;
+
+    if (pool->wait_tail)
+        pool->wait_tail->next = &w;
+    else
+        pool->wait_head = &w;
+    pool->wait_tail = &w;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (!w.ptr) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&w.cond, &pool->lock);
+        else if (pthread_cond_timedwait(&w.cond, &pool->lock,
+                                        &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if (w.ptr) {
+        pool->stats.alloc_reserve++;
+    } else {
+        mempool_dequeue_waiter(pool, &w);
+        pool->stats.alloc_failed++;
+    }
+    ptr = w.ptr;
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_destroy(&w.cond);
+    return ptr;
+}
+
+/*
+ * Give an element to the oldest waiter or put it in the reserve, with
+ * pool->lock held. Returns false if the caller must free it.
+ */
+static bool mempool_put_locked(struct mempool *pool, void *ptr)
+{
+    struct mempool_element *elem;
+    struct mempool_waiter *w;
+
+    if ((w = pool->wait_head)) {
+        /* Hand the element straight to the oldest waiter */
+        pool->wait_head = w->next;
+        if (!pool->wait_head)
+            pool->wait_tail = NULL;
+        w->ptr = ptr;
+        pthread_cond_signal(&w->cond);
+        pool->stats.free_reserve++;
+        return true;
+    }
+
+    if (pool->curr_nr < pool->min_nr && pool->spare) {
+        /* Refill the reserve */
+        elem = pool->spare;
+        pool->spare = elem->next;
+        elem->ptr = ptr;
+        elem->next = pool->elements;
+        pool->elements = elem;
+        pool->curr_nr++;
+        pool->stats.free_reserve++;
+        return true;
+    }
+
+    return false;
+}
+
+/* Return element to pool */
+static void mempool_free(struct mempool *pool, void *ptr)
+{
+    if (!pool || !ptr)
+        return;
+
+    mempool_lock(pool);
+
+    if (!mempool_put_locked(pool, ptr)) {
+        /* Free if reserve is full */
+        pool->free(ptr, pool->pool_data);
+        pool->total_nr--;
+        pool->stats.free_backing++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Allocate up to nr elements under a single lock acquisition. The backing
+ * allocator is asked for the whole run in one call, and the reserve covers
+ * whatever it could not supply. Returns the number of elements stored in
+ * ptrs.
+ */
+static size_t mempool_alloc_bulk(struct mempool *pool, void **ptrs, size_t nr)
+{
+    struct mempool_element *elem;
+    size_t quota, done = 0;
+
+    if (!pool || !ptrs || !nr)
+        return 0;
+
+    mempool_lock(pool);
+
+    /* total_nr can sit above max_nr after the limit was lowered */
+    quota = pool->total_nr < pool->max_nr ? pool->max_nr - pool->total_nr : 0;
+    if (quota > nr)
+        quota = nr;
+    if (pool->alloc_bulk) {
+        done = pool->alloc_bulk(pool->elem_size, quota, ptrs, pool->pool_data);
+    } else {
+        while (done < quota &&
+               (ptrs[done] = pool->alloc(pool->elem_size, pool->pool_data)))
+            done++;
+    }
+    pool->total_nr += done;
+    if (pool->total_nr > pool->stats.total_high)
+        pool->stats.total_high = pool->total_nr;
+    pool->stats.alloc_backing += done;
+
+    while (done < nr && pool->elements) {
+        elem = pool->elements;
+        pool->elements = elem->next;
+        ptrs[done++] = elem->ptr;
+        elem->next = pool->spare;
+        pool->spare = elem;
+        pool->curr_nr--;
+        pool->stats.alloc_reserve++;
+    }
+    if (pool->curr_nr < pool->stats.reserve_low)
+        pool->stats.reserve_low = pool->curr_nr;
+    pool->stats.alloc_failed += nr - done;
+
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+/*
+ * Return nr elements under a single lock acquisition. Waiters and the
+ * reserve are served first; the rest go back to the backing allocator in
+ * one call.
+ */
+static void mempool_free_bulk(struct mempool *pool, void **ptrs, size_t nr)
+{
+    size_t i = 0, j;
+
+    if (!pool || !ptrs || !nr)
+        return;
+
+    mempool_lock(pool);
+
+    while (i < nr && mempool_put_locked(pool, ptrs[i]))
+        i++;
+
+    if (i < nr) {
+        if (pool->free_bulk) {
+            pool->free_bulk(ptrs + i, nr - i, pool->pool_data);
+        } else {
+            for (j = i; j < nr; j++)
+                pool->free(ptrs[j], pool->pool_data);
+        }
+        pool->total_nr -= nr - i;
+        pool->stats.free_backing += nr - i;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Allocate an empty magazine */
+static struct mempool_magazine *mempool_mag_new(size_t mag_size)
+{
+    struct mempool_magazine *mag;
+
+    mag = malloc(sizeof(*mag) + mag_size * sizeof(void *));
+    if (!mag)
+        return NULL;
+
+    mag->next = NULL;
+    mag->rounds = 0;
+    return mag;
+}
+
+/* Hand a magazine back to the depot, draining it first if partially full */
+static void mempool_mag_return(struct mempool *pool, struct mempool_magazine *mag)
+{
+    struct mempool_depot *depot = pool->depot;
+
+    if (mag->rounds && mag->rounds < depot->mag_size) {
+        while (mag->rounds)
+            mempool_free(pool, mag->objs[--mag->rounds]);
+    }
+
+    pthread_mutex_lock(&depot->lock);
+    if (mag->rounds) {
+        mag->next = depot->full;
+        depot->full = mag;
+        depot->full_nr++;
+        depot->full_puts++;
+    } else {
+        mag->next = depot->empty;
+        depot->empty = mag;
+        depot->empty_nr++;
+        depot->empty_puts++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/* Return the calling thread's magazines to the depot */
+static void mempool_cache_destructor(void *arg)
+{
+    struct mempool_cpu_cache *cc = arg;
+
+    if (!cc)
+        return;
+
+    mempool_mag_return(cc->pool, cc->loaded);
+    mempool_mag_return(cc->pool, cc->previous);
+    free(cc);
+}
+
+/* Look up (or lazily create) the calling thread's magazine cache */
+static struct mempool_cpu_cache *mempool_get_cache(struct mempool *pool)
+{
+    struct mempool_depot *depot = pool->depot;
+    struct mempool_cpu_cache *cc;
+
+    cc = pthread_getspecific(depot->key);
+    if (cc)
+        return cc;
+
+    cc = malloc(sizeof(*cc));
+    if (!cc)
+        return NULL;
+
+    cc->pool = pool;
+    cc->loaded = mempool_mag_new(depot->mag_size);
+    cc->previous = mempool_mag_new(depot->mag_size);
+    if (!cc->loaded || !cc->previous ||
+        pthread_setspecific(depot->key, cc) != 0) {
+        free(cc->loaded);
+        free(cc->previous);
+        free(cc);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&depot->lock);
+    depot->mag_allocs += 2;
+    pthread_mutex_unlock(&depot->lock);
+    return cc;
+}
+
+/* Enable per-thread magazines in front of the pool */
+static int mempool_magazine_init(struct mempool *pool, size_t mag_size)
+{
+    struct mempool_depot *depot;
+
+    if (!pool || pool->depot || !mag_size || mag_size > MEMPOOL_MAG_MAX)
+        return -1;
+
+    depot = calloc(1, sizeof(*depot));
+    if (!depot)
+        return -1;
+
+    depot->mag_size = mag_size;
+    if (pthread_mutex_init(&depot->lock, NULL) != 0) {
+        free(depot);
+        return -1;
+    }
+    if (pthread_key_create(&depot->key, mempool_cache_destructor) != 0) {
+        pthread_mutex_destroy(&depot->lock);
+        free(depot);
+        return -1;
+    }
+
+    pool->depot = depot;
+    return 0;
+}
+
+/* Allocate element through the calling thread's magazines */
+static void *mempool_cache_alloc(struct mempool *pool)
+{
+    struct mempool_depot *depot;
+    struct mempool_cpu_cache *cc;
+    struct mempool_magazine *mag;
+
+    if (!pool)
+        return NULL;
+
+    depot = pool->depot;
+    if (!depot)
+        return mempool_alloc(pool);
+
+    cc = mempool_get_cache(pool);
+    if (!cc)
+        return mempool_alloc(pool);
+
+    if (cc->loaded->rounds)
+        return cc->loaded->objs[--cc->loaded->rounds];
+
+    if (cc->previous->rounds) {
+        mag = cc->loaded;
+        cc->loaded = cc->previous;
+        cc->previous = mag;
+        return cc->loaded->objs[--cc->loaded->rounds];
+    }
+
+    /* Both magazines empty: trade the previous one for a full one */
+    pthread_mutex_lock(&depot->lock);
+    if (depot->full) {
+        mag = depot->full;
+        depot->full = mag->next;
+        depot->full_nr--;
+        depot->full_gets++;
+
+        cc->previous->next = depot->empty;
+        depot->empty = cc->previous;
+        depot->empty_nr++;
+        depot->empty_puts++;
+        pthread_mutex_unlock(&depot->lock);
+
+        cc->previous = cc->loaded;
+        cc->loaded = mag;
+        return cc->loaded->objs[--cc->loaded->rounds];
+    }
+    depot->pool_allocs++;
+    pthread_mutex_unlock(&depot->lock);
+
+    return mempool_alloc(pool);
+}
+
+/* Return element through the calling thread's magazines */
+static void mempool_cache_free(struct mempool *pool, void *ptr)
+{
+    struct mempool_depot *depot;
+    struct mempool_cpu_cache *cc;
+    struct mempool_magazine *mag;
+
+    if (!pool || !ptr)
+        return;
+
+    depot = pool->depot;
+    if (!depot) {
+        mempool_free(pool, ptr);
+        return;
+    }
+
+    cc = mempool_get_cache(pool);
+    if (!cc) {
+        mempool_free(pool, ptr);
+        return;
+    }
+
+    if (cc->loaded->rounds < depot->mag_size) {
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        return;
+    }
+
+    if (!cc->previous->rounds) {
+        mag = cc->loaded;
+        cc->loaded = cc->previous;
+        cc->previous = mag;
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        return;
+    }
+
+    /* Both magazines full: trade the previous one for an empty one */
+    pthread_mutex_lock(&depot->lock);
+    mag = depot->empty;
+    if (mag) {
+        depot->empty = mag->next;
+        depot->empty_nr--;
+        depot->empty_gets++;
+    } else {
+        pthread_mutex_unlock(&depot->lock);
+        mag = mempool_mag_new(depot->mag_size);
+        pthread_mutex_lock(&depot->lock);
+        if (mag)
+            depot->mag_allocs++;
+    }
+
+    if (mag) {
+        cc->previous->next = depot->full;
+        depot->full = cc->previous;
+        depot->full_nr++;
+        depot->full_puts++;
+        pthread_mutex_unlock(&depot->lock);
+
+        cc->previous = cc->loaded;
+        cc->loaded = mag;
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        return;
+    }
+    depot->pool_frees++;
+    pthread_mutex_unlock(&depot->lock);
+
+    mempool_free(pool, ptr);
+}
+
+/*
+ * Return the calling thread's magazines to the depot. Threads that exit
+ * do this automatically; long-lived threads must call it before the pool
+ * is destroyed.
+ */
+static void mempool_magazine_flush(struct mempool *pool)
+{
+    struct mempool_cpu_cache *cc;
+
+    if (!pool || !pool->depot)
+        return;
+
+    cc = pthread_getspecific(pool->depot->key);
+    if (!cc)
+        return;
+
+    pthread_setspecific(pool->depot->key, NULL);
+    mempool_cache_destructor(cc);
+}
+
+/* Tear down the depot, releasing every cached object */
+static void mempool_magazine_destroy(struct mempool *pool)
+{
+    struct mempool_depot *depot = pool->depot;
+    struct mempool_magazine *mag;
+
+    if (!depot)
+        return;
+
+    mempool_magazine_flush(pool);
+
+    while ((mag = depot->full)) {
+        depot->full = mag->next;
+        while (mag->rounds)
+            pool->free(mag->objs[--mag->rounds], pool->pool_data);
+        free(mag);
+    }
+    while ((mag = depot->empty)) {
+        depot->empty = mag->next;
+        free(mag);
+    }
+
+    pthread_key_delete(depot->key);
+    pthread_mutex_destroy(&depot->lock);
+    free(depot);
+    pool->depot = NULL;
+}
+
+/* Destroy memory pool */
+static void mempool_destroy(struct mempool *pool)
+{
+    if (!pool)
+        return;
+
+    mempool_magazine_destroy(pool);
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->elements) {
+        struct mempool_element *elem = pool->elements;
+        pool->elements = elem->next;
+        pool->free(elem->ptr, pool->pool_data);
+        free(elem);
+    }
+    while (pool->spare) {
+        struct mempool_element *elem = pool->spare;
+        pool->spare = elem->next;
+        free(elem);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* Print pool statistics */
+static void print_pool_stats(struct mempool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    printf("\nMempool Statistics:\n");
+    printf("Minimum elements: %zu\n", pool->min_nr);
+    printf("Current elements: %zu\n", pool->curr_nr);
+    printf("Total elements: %zu\n", pool->total_nr);
+    printf("Element size: %zu bytes\n", pool->elem_size);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Copy the pool's counters and state under its lock */
+static void mempool_get_snapshot(struct mempool *pool, struct mempool_snapshot *snap)
+{
+    pthread_mutex_lock(&pool->lock);
+    snap->min_nr = pool->min_nr;
+    snap->curr_nr = pool->curr_nr;
+    snap->total_nr = pool->total_nr;
+    snap->max_nr = pool->max_nr;
+    snap->stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Clear counters; watermarks restart from the current state */
+static void mempool_reset_stats(struct mempool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.reserve_low = pool->curr_nr;
+    pool->stats.total_high = pool->total_nr;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Print pool usage and contention telemetry */
+static void print_pool_telemetry(const char *name, struct mempool *pool)
+{
+    struct mempool_snapshot snap;
+    const struct mempool_stats *st = &snap.stats;
+
+    if (!pool)
+        return;
+
+    mempool_get_snapshot(pool, &snap);
+    printf("\nMempool %s Telemetry:\n", name);
+    printf("Allocations: %lu backing, %lu reserve, %lu failed, %lu waited\n",
+           st->alloc_backing, st->alloc_reserve, st->alloc_failed,
+           st->alloc_waited);
+    printf("Frees: %lu to reserve, %lu to backing\n",
+           st->free_reserve, st->free_backing);
+    printf("Reserve: min_nr %zu, deepest use %zu\n",
+           snap.min_nr, snap.min_nr - st->reserve_low);
+    printf("Elements: %zu live, high-water %zu, limit %zu\n",
+           snap.total_nr, st->total_high, snap.max_nr);
+    printf("Lock: %lu acquires, %lu contended, %.1f us waited (max %.1f us)\n",
+           st->lock_acquires, st->lock_contended, st->lock_wait_ns / 1e3,
+           st->lock_wait_max_ns / 1e3);
+}
+
+/* Print magazine depot statistics */
+static void print_depot_stats(struct mempool *pool)
+{
+    struct mempool_depot *depot;
+
+    if (!pool || !pool->depot)
+        return;
+
+    depot = pool->depot;
+    pthread_mutex_lock(&depot->lock);
+    printf("\nMagazine Depot Statistics:\n");
+    printf("Magazine size: %zu rounds\n", depot->mag_size);
+    printf("Full magazines: %zu\n", depot->full_nr);
+    printf("Empty magazines: %zu\n", depot->empty_nr);
+    printf("Magazines created: %lu\n", depot->mag_allocs);
+    printf("Full gets/puts: %lu/%lu\n", depot->full_gets, depot->full_puts);
+    printf("Empty gets/puts: %lu/%lu\n", depot->empty_gets, depot->empty_puts);
+    printf("Pool fallbacks (alloc/free): %lu/%lu\n",
+           depot->pool_allocs, depot->pool_frees);
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/* Count the operations that took the depot lock, for tests */
+static unsigned long depot_lock_ops(struct mempool *pool)
+{
+    struct mempool_depot *depot = pool->depot;
+    unsigned long ops;
+
+    pthread_mutex_lock(&depot->lock);
+    ops = depot->full_gets + depot->full_puts + depot->empty_gets +
+          depot->empty_puts + depot->mag_allocs + depot->pool_allocs +
+          depot->pool_frees;
+    pthread_mutex_unlock(&depot->lock);
+    return ops;
+}
+
+/*
+ * Slab cache allocator (Bonwick, "The Slab Allocator").
+ *
+ * A slab is a naturally aligned block of slab_size bytes, so the owning
+ * slab of any object is found by masking its address. The slab header and
+ * a bufctl array of next-free indices sit at the start of the block; the
+ * objects follow after a per-slab colour offset that staggers them across
+ * cache lines. Keeping the free list out of the objects preserves state
+ * set up by the constructor across free and reallocation.
+ */
+struct slab {
+    struct list_head list;   /* On one of the cache's slab lists */
+    void *s_mem;             /* First object */
+    unsigned int inuse;      /* Objects allocated */
+    unsigned int free;       /* Index of first free object */
+    unsigned short freelist[]; /* Next free index per object */
+};
+
+#define SLAB_FREELIST_END  ((unsigned short)~0)
+
+struct kmem_cache {
+    const char *name;
+    size_t object_size;      /* Requested object size */
+    size_t size;             /* Object stride */
+    size_t slab_size;        /* Bytes per slab, power of two */
+    size_t mgmt_size;        /* Slab header plus freelist */
+    unsigned int num;        /* Objects per slab */
+    unsigned int colour;     /* Number of distinct colours */
+    unsigned int colour_next;
+    size_t colour_off;       /* Colour step */
+    void (*ctor)(void *);    /* Object constructor, may be NULL */
+    pthread_mutex_t lock;
+    struct list_head slabs_partial;
+    struct list_head slabs_full;
+    struct list_head slabs_free;
+    unsigned long nr_slabs;
+    unsigned long active_objs;
+};
+
+/* Create a cache of fixed-size objects */
+static struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                            size_t align, void (*ctor)(void *))
+{
+    struct kmem_cache *cache;
+    size_t slab_size, mgmt, left;
+    unsigned int num;
+
+    if (!size)
+        return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (align & (align - 1))
+        return NULL;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->size = (size + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+
+    /* Double the slab until it holds SLAB_MIN_OBJS objects */
+    for (slab_size = SLAB_PAGE_SIZE; ; slab_size <<= 1) {
+        num = (slab_size - sizeof(struct slab)) /
+              (cache->size + sizeof(unsigned short));
+        if (num > SLAB_FREELIST_END - 1)
+            num = SLAB_FREELIST_END - 1;
+        while (num) {
+            mgmt = sizeof(struct slab) + num * sizeof(unsigned short);
+            mgmt = (mgmt + align - 1) & ~(align - 1);
+            if (mgmt + num * cache->size <= slab_size)
+                break;
+            num--;
+        }
+        if (num >= SLAB_MIN_OBJS)
+            break;
+    }
+
+    left = slab_size - mgmt - num * cache->size;
+    cache->slab_size = slab_size;
+    cache->mgmt_size = mgmt;
+    cache->num = num;
+    cache->colour_off = align > SLAB_COLOUR_ALIGN ? align : SLAB_COLOUR_ALIGN;
+    cache->colour = left / cache->colour_off + 1;
+    cache->colour_next = 0;
+
+    INIT_LIST_HEAD(&cache->slabs_partial);
+    INIT_LIST_HEAD(&cache->slabs_full);
+    INIT_LIST_HEAD(&cache->slabs_free);
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/* Allocate and construct a new slab, called with cache->lock held */
+static struct slab *kmem_cache_grow(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    unsigned int i;
+
+    slab = aligned_alloc(cache->slab_size, cache->slab_size);
+    if (!slab)
+        return NULL;
+
+    slab->s_mem = (char *)slab + cache->mgmt_size +
+                  cache->colour_next * cache->colour_off;
+    if (++cache->colour_next >= cache->colour)
+        cache->colour_next = 0;
+
+    slab->inuse = 0;
+    slab->free = 0;
+    for (i = 0; i < cache->num; i++) {
+        slab->freelist[i] = i + 1;
+        if (cache->ctor)
+            cache->ctor((char *)slab->s_mem + i * cache->size);
+    }
+    slab->freelist[cache->num - 1] = SLAB_FREELIST_END;
+
+    list_add(&slab->list, &cache->slabs_free);
+    cache->nr_slabs++;
+    return slab;
+}
+
+/* Allocate an object with cache->lock held */
+static void *kmem_cache_alloc_locked(struct kmem_cache *cache)
+{
+    struct list_head *head;
+    struct slab *slab;
+    void *obj;
+
+    if (!list_empty(&cache->slabs_partial))
+        head = &cache->slabs_partial;
+    else if (!list_empty(&cache->slabs_free) || kmem_cache_grow(cache))
+        head = &cache->slabs_free;
+    else
+        return NULL;
+
+    slab = list_entry(head->next, struct slab, list);
+    obj = (char *)slab->s_mem + slab->free * cache->size;
+    slab->free = slab->freelist[slab->free];
+    slab->inuse++;
+    cache->active_objs++;
+
+    if (slab->inuse == cache->num)
+        list_move(&slab->list, &cache->slabs_full);
+    else if (slab->inuse == 1)
+        list_move(&slab->list, &cache->slabs_partial);
+
+    return obj;
+}
+
+/* Free an object with cache->lock held; empty slabs are kept until shrink */
+static void kmem_cache_free_locked(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab;
+    unsigned int idx;
+
+    slab = (struct slab *)((uintptr_t)obj & ~(uintptr_t)(cache->slab_size - 1));
+    idx = ((char *)obj - (char *)slab->s_mem) / cache->size;
+
+    slab->freelist[idx] = slab->free;
+    slab->free = idx;
+    slab->inuse--;
+    cache->active_objs--;
+
+    if (slab->inuse == 0)
+        list_move(&slab->list, &cache->slabs_free);
+    else if (slab->inuse == cache->num - 1)
+        list_move(&slab->list, &cache->slabs_partial);
+}
+
+/* Allocate an object */
+static void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    void *obj;
+
+    if (!cache)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    obj = kmem_cache_alloc_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return obj;
+}
+
+/* Free an object */
+static void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (!cache || !obj)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    kmem_cache_free_locked(cache, obj);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Allocate up to nr objects under one lock; returns the number allocated */
+static size_t kmem_cache_alloc_bulk(struct kmem_cache *cache, size_t nr,
+                                    void **ptrs)
+{
+    size_t i;
+
+    if (!cache)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < nr; i++) {
+        ptrs[i] = kmem_cache_alloc_locked(cache);
+        if (!ptrs[i])
+            break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return i;
+}
+
+/* Free nr objects under one lock */
+static void kmem_cache_free_bulk(struct kmem_cache *cache, size_t nr,
+                                 void **ptrs)
+{
+    size_t i;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < nr; i++)
+        kmem_cache_free_locked(cache, ptrs[i]);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Release all empty slabs */
+static void kmem_cache_shrink(struct kmem_cache *cache)
+{
+    struct slab *slab;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!list_empty(&cache->slabs_free)) {
+        slab = list_entry(cache->slabs_free.next, struct slab, list);
+        list_del(&slab->list);
+        cache->nr_slabs--;
+        free(slab);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Destroy a cache; all objects must have been freed */
+static void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    struct list_head *lists[3];
+    struct slab *slab;
+    size_t i;
+
+    if (!cache)
+        return;
+
+    lists[0] = &cache->slabs_partial;
+    lists[1] = &cache->slabs_full;
+    lists[2] = &cache->slabs_free;
+
+    if (cache->active_objs)
+        printf("kmem_cache %s: destroyed with %lu objects in use\n",
+               cache->name, cache->active_objs);
+
+    for (i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        while (!list_empty(lists[i])) {
+            slab = list_entry(lists[i]->next, struct slab, list);
+            list_del(&slab->list);
+            free(slab);
+        }
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/* Print slab cache statistics */
+static void print_cache_stats(struct kmem_cache *cache)
+{
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    printf("\nSlab Cache %s Statistics:\n", cache->name);
+    printf("Object size: %zu bytes (stride %zu)\n",
+           cache->object_size, cache->size);
+    printf("Slab size: %zu bytes, %u objects, %u colours\n",
+           cache->slab_size, cache->num, cache->colour);
+    printf("Slabs: %lu\n", cache->nr_slabs);
+    printf("Active objects: %lu\n", cache->active_objs);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Mempool backend on top of a slab cache */
+static void *mempool_alloc_slab(size_t size, void *pool_data)
+{
+    (void)size;
+    return kmem_cache_alloc(pool_data);
+}
+
+static void mempool_free_slab(void *element, void *pool_data)
+{
+    kmem_cache_free(pool_data, element);
+}
+
+static size_t mempool_alloc_slab_bulk(size_t size, size_t nr, void **ptrs,
+                                      void *pool_data)
+{
+    (void)size;
+    return kmem_cache_alloc_bulk(pool_data, nr, ptrs);
+}
+
+static void mempool_free_slab_bulk(void **ptrs, size_t nr, void *pool_data)
+{
+    kmem_cache_free_bulk(pool_data, nr, ptrs);
+}
+
+static struct mempool *mempool_create_slab_pool(size_t min_nr,
+                                                struct kmem_cache *cache)
+{
+    struct mempool *pool;
+
+    pool = mempool_create(min_nr, cache->object_size, mempool_alloc_slab,
+                          mempool_free_slab, cache);
+    if (pool) {
+        pool->alloc_bulk = mempool_alloc_slab_bulk;
+        pool->free_bulk = mempool_free_slab_bulk;
+    }
+    return pool;
+}
+
+/*
+ * Lock-free mempool variant.
+ *
+ * The reserve is a Treiber stack threaded through a fixed array of min_nr
+ * nodes, and a second stack holds the nodes not currently carrying an
+ * element, mirroring the spare list of struct mempool. Stack heads pack a
+ * 32-bit node index with a 32-bit generation tag that is bumped on every
+ * update, so a 64-bit CAS detects ABA without needing 128-bit atomics.
+ * Nodes are never freed, so reading a stale next index is harmless.
+ * There is no blocking allocation in this variant.
+ */
+#define LF_NIL             UINT32_MAX
+
+struct mempool_lf_node {
+    void *ptr;
+    _Atomic uint32_t next;
+};
+
+struct mempool_lf {
+    size_t min_nr;           /* Minimum number of elements */
+    size_t max_nr;           /* Maximum value of total_nr */
+    size_t elem_size;        /* Size of each element */
+    atomic_size_t curr_nr;   /* Elements in reserve */
+    atomic_size_t total_nr;  /* Elements in reserve plus in use */
+    _Atomic uint64_t elements; /* Tagged head of the reserve stack */
+    _Atomic uint64_t spare;    /* Tagged head of the unused node stack */
+    struct mempool_lf_node *nodes;
+    mempool_alloc_t *alloc;
+    mempool_free_t *free;
+    void *pool_data;
+};
+
+static uint32_t lf_stack_pop(struct mempool_lf *pool, _Atomic uint64_t *head)
+{
+    uint64_t old, new;
+    uint32_t idx;
+
+    old = atomic_load_explicit(head, memory_order_acquire);
+    do {
+        idx = (uint32_t)old;
+        if (idx == LF_NIL)
+            return LF_NIL;
+        new = ((old >> 32) + 1) << 32 |
+              atomic_load_explicit(&pool->nodes[idx].next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, new,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+    return idx;
+}
+
+static void lf_stack_push(struct mempool_lf *pool, _Atomic uint64_t *head,
+                          uint32_t idx)
+{
+    uint64_t old, new;
+
+    old = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&pool->nodes[idx].next, (uint32_t)old,
+                              memory_order_relaxed);
+        new = ((old >> 32) + 1) << 32 | idx;
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, new,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/* Initialize lock-free memory pool */
+static struct mempool_lf *mempool_lf_create(
+    size_t min_nr,
+    size_t elem_size,
+    mempool_alloc_t *alloc_fn,
+    mempool_free_t *free_fn,
+    void *pool_data)
+{
+    struct mempool_lf *pool;
+    size_t i;
+
+    if (!min_nr || min_nr >= LF_NIL || !elem_size)
+        return NULL;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->nodes = calloc(min_nr, sizeof(*pool->nodes));
+    if (!pool->nodes) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->min_nr = min_nr;
+    pool->max_nr = MEMPOOL_MAX_SIZE;
+    pool->elem_size = elem_size;
+    pool->alloc = alloc_fn ? alloc_fn : mempool_alloc_node;
+    pool->free = free_fn ? free_fn : mempool_free_node;
+    pool->pool_data = pool_data;
+    atomic_init(&pool->elements, LF_NIL);
+    atomic_init(&pool->spare, LF_NIL);
+
+    /* Pre-allocate minimum number of elements */
+    for (i = 0; i < min_nr; i++) {
+        pool->nodes[i].ptr = pool->alloc(elem_size, pool_data);
+        if (!pool->nodes[i].ptr)
+            goto cleanup;
+        lf_stack_push(pool, &pool->elements, i);
+    }
+    atomic_init(&pool->curr_nr, min_nr);
+    atomic_init(&pool->total_nr, min_nr);
+
+    return pool;
+
+cleanup:
+    while (i--)
+        pool->free(pool->nodes[i].ptr, pool_data);
+    free(pool->nodes);
+    free(pool);
+    return NULL;
+}
+
+/* Allocate element; the reserve is tapped only if the backing allocator fails */
+static void *mempool_lf_alloc(struct mempool_lf *pool)
+{
+    size_t total;
+    uint32_t idx;
+    void *ptr;
+
+    if (!pool)
+        return NULL;
+
+    total = atomic_load_explicit(&pool->total_nr, memory_order_relaxed);
+    while (total < pool->max_nr) {
+        if (!atomic_compare_exchange_weak_explicit(&pool->total_nr, &total,
+                                                   total + 1,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+            continue;
+        ptr = pool->alloc(pool->elem_size, pool->pool_data);
+        if (ptr)
+            return ptr;
+        atomic_fetch_sub_explicit(&pool->total_nr, 1, memory_order_relaxed);
+        break;
+    }
+
+    idx = lf_stack_pop(pool, &pool->elements);
+    if (idx == LF_NIL)
+        return NULL;
+
+    ptr = pool->nodes[idx].ptr;
+    atomic_fetch_sub_explicit(&pool->curr_nr, 1, memory_order_relaxed);
+    lf_stack_push(pool, &pool->spare, idx);
+    return ptr;
+}
+
+/* Return element; refills the reserve while it has free nodes */
+static void mempool_lf_free(struct mempool_lf *pool, void *ptr)
+{
+    uint32_t idx;
+
+    if (!pool || !ptr)
+        return;
+
+    idx = lf_stack_pop(pool, &pool->spare);
+    if (idx == LF_NIL) {
+        pool->free(ptr, pool->pool_data);
+        atomic_fetch_sub_explicit(&pool->total_nr, 1, memory_order_relaxed);
+        return;
+    }
+
+    pool->nodes[idx].ptr = ptr;
+    atomic_fetch_add_explicit(&pool->curr_nr, 1, memory_order_relaxed);
+    lf_stack_push(pool, &pool->elements, idx);
+}
+
+/* Destroy lock-free pool; all elements must have been returned */
+static void mempool_lf_destroy(struct mempool_lf *pool)
+{
+    uint32_t idx;
+
+    if (!pool)
+        return;
+
+    while ((idx = lf_stack_pop(pool, &pool->elements)) != LF_NIL)
+        pool->free(pool->nodes[idx].ptr, pool->pool_data);
+
+    free(pool->nodes);
+    free(pool);
+}
+
+/*
+ * Arena backing store.
+ *
+ * One contiguous mapping is carved into fixed-size elements, so a pool of
+ * millions of small objects is covered by a handful of huge TLB entries
+ * instead of being scattered over the malloc heap. With ARENA_HUGETLB the
+ * region comes from explicit hugetlb pages when the system has them
+ * reserved; otherwise it is 2MB aligned and advised for transparent huge
+ * pages. Free elements are linked through their first word.
+ */
+struct mempool_arena {
+    void *base;              /* Start of the mapping */
+    size_t map_size;         /* Bytes mapped */
+    size_t stride;           /* Bytes per element */
+    size_t nr_elems;         /* Elements carved from the mapping */
+    size_t nr_free;          /* Elements on the free list */
+    void *freelist;          /* Free elements */
+    int node;                /* NUMA node the memory is bound to, or -1 */
+    bool hugetlb;            /* Backed by explicit hugetlb pages */
+    pthread_mutex_t lock;
+};
+
+/* Map a 2MB aligned region advised for THP, or hugetlb pages if asked */
+static void *arena_map(size_t size, bool try_hugetlb, bool *hugetlb)
+{
+    char *addr, *aligned;
+    size_t head;
+
+    *hugetlb = false;
+    if (try_hugetlb) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            *hugetlb = true;
+            return addr;
+        }
+    }
+
+    addr = mmap(NULL, size + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    /* Trim to a 2MB aligned window so THP can back every huge page */
+    aligned = (char *)(((uintptr_t)addr + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1));
+    head = aligned - addr;
+    if (head)
+        munmap(addr, head);
+    munmap(aligned + size, HPAGE_SIZE - head);
+
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/* Create an arena of nr_elems elements, bound to node unless it is -1 */
+static struct mempool_arena *mempool_arena_create(size_t nr_elems, size_t elem_size,
+                                                  int node, int flags)
+{
+    struct mempool_arena *arena;
+    unsigned long mask[MAX_NUMNODES / (sizeof(unsigned long) * 8)];
+    size_t i;
+
+    if (!nr_elems || !elem_size)
+        return NULL;
+
+    arena = calloc(1, sizeof(*arena));
+    if (!arena)
+        return NULL;
+
+    arena->stride = (elem_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    arena->map_size = (nr_elems * arena->stride + HPAGE_SIZE - 1) &
+                      ~(HPAGE_SIZE - 1);
+    arena->base = arena_map(arena->map_size, flags & ARENA_HUGETLB,
+                            &arena->hugetlb);
+    if (!arena->base) {
+        free(arena);
+        return NULL;
+    }
+
+    /* Bind before first touch; failure just leaves first-touch placement */
+    arena->node = -1;
+    if (node >= 0 && node < MAX_NUMNODES) {
+        memset(mask, 0, sizeof(mask));
+        mask[node / (sizeof(unsigned long) * 8)] =
+            1UL << (node % (sizeof(unsigned long) * 8));
+        /* The kernel reads maxnode - 1 bits, so pass one more (as libnuma) */
+        if (syscall(SYS_mbind, arena->base, arena->map_size, MPOL_BIND,
+                    mask, MAX_NUMNODES + 1, 0) == 0)
+            arena->node = node;
+    }
+
+    if (pthread_mutex_init(&arena->lock, NULL) != 0) {
+        munmap(arena->base, arena->map_size);
+        free(arena);
+        return NULL;
+    }
+
+    /* Thread the free list in address order */
+    arena->nr_elems = arena->map_size / arena->stride;
+    for (i = arena->nr_elems; i-- > 0; ) {
+        void *elem = (char *)arena->base + i * arena->stride;
+        *(void **)elem = arena->freelist;
+        arena->freelist = elem;
+    }
+    arena->nr_free = arena->nr_elems;
+
+    return arena;
+}
+
+static bool arena_contains(struct mempool_arena *arena, void *ptr)
+{
+    return (char *)ptr >= (char *)arena->base &&
+           (char *)ptr < (char *)arena->base + arena->map_size;
+}
+
+static void mempool_arena_destroy(struct mempool_arena *arena)
+{
+    if (!arena)
+        return;
+
+    pthread_mutex_destroy(&arena->lock);
+    munmap(arena->base, arena->map_size);
+    free(arena);
+}
+
+/* Mempool backend on top of an arena */
+static void *mempool_alloc_arena(size_t size, void *pool_data)
+{
+    struct mempool_arena *arena = pool_data;
+    void *elem;
+
+    (void)size;
+    pthread_mutex_lock(&arena->lock);
+    elem = arena->freelist;
+    if (elem) {
+        arena->freelist = *(void **)elem;
+        arena->nr_free--;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return elem;
+}
+
+static void mempool_free_arena(void *element, void *pool_data)
+{
+    struct mempool_arena *arena = pool_data;
+
+    pthread_mutex_lock(&arena->lock);
+    *(void **)element = arena->freelist;
+    arena->freelist = element;
+    arena->nr_free++;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static struct mempool *mempool_create_arena_pool(size_t min_nr,
+                                                 struct mempool_arena *arena)
+{
+    struct mempool *pool;
+
+    pool = mempool_create(min_nr, arena->stride, mempool_alloc_arena,
+                          mempool_free_arena, arena);
+    if (pool)
+        pool->max_nr = arena->nr_elems;
+    return pool;
+}
+
+/*
+ * NUMA-local pools: one arena-backed pool per online node. Allocation uses
+ * the pool of the node the calling thread is running on; free returns the
+ * element to the pool whose arena it came from.
+ */
+struct mempool_numa {
+    int nr_nodes;
+    struct mempool_arena *arenas[MAX_NUMNODES];
+    struct mempool *pools[MAX_NUMNODES];
+    atomic_ulong bad_frees;     /* Frees of pointers from no node's arena */
+};
+
+/* Number of online nodes, from the last entry of the sysfs range list */
+static int numa_nr_nodes(void)
+{
+    char buf[256], *p;
+    int nr = 1;
+    FILE *f;
+
+    f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 1;
+    if (fgets(buf, sizeof(buf), f)) {
+        p = strrchr(buf, ',');
+        p = p ? p + 1 : buf;
+        if (strchr(p, '-'))
+            p = strchr(p, '-') + 1;
+        nr = atoi(p) + 1;
+    }
+    fclose(f);
+
+    if (nr < 1)
+        nr = 1;
+    return nr > MAX_NUMNODES ? MAX_NUMNODES : nr;
+}
+
+static int numa_current_node(void)
+{
+    unsigned int cpu, node;
+
+    if (getcpu(&cpu, &node) != 0 || node >= MAX_NUMNODES)
+        return 0;
+    return node;
+}
+
+static void mempool_numa_destroy(struct mempool_numa *np);
+
+static struct mempool_numa *mempool_numa_create(size_t min_nr, size_t elem_size,
+                                                size_t nr_per_node, int flags)
+{
+    struct mempool_numa *np;
+    int node;
+
+    np = calloc(1, sizeof(*np));
+    if (!np)
+        return NULL;
+
+    np->nr_nodes = numa_nr_nodes();
+    for (node = 0; node < np->nr_nodes; node++) {
+        np->arenas[node] = mempool_arena_create(nr_per_node, elem_size,
+                                                np->nr_nodes > 1 ? node : -1,
+                                                flags);
+        if (!np->arenas[node])
+            goto fail;
+        np->pools[node] = mempool_create_arena_pool(min_nr, np->arenas[node]);
+        if (!np->pools[node])
+            goto fail;
+    }
+
+    return np;
+
+fail:
+    mempool_numa_destroy(np);
+    return NULL;
+}
+
+static void *mempool_numa_alloc(struct mempool_numa *np)
+{
+    int node = numa_current_node();
+
+    if (node >= np->nr_nodes)
+        node = 0;
+    return mempool_alloc(np->pools[node]);
+}
+
+static void mempool_numa_free(struct mempool_numa *np, void *ptr)
+{
+    int node;
+
+    if (!ptr)
+        return;
+
+    for (node = 0; node < np->nr_nodes; node++) {
+        if (arena_contains(np->arenas[node], ptr)) {
+            mempool_free(np->pools[node], ptr);
+            return;
+        }
+    }
+
+    /* Not ours: no pool can take it back, and free() would be wrong */
+    atomic_fetch_add_explicit(&np->bad_frees, 1, memory_order_relaxed);
+    fprintf(stderr, "mempool_numa_free: %p is not in any node arena\n", ptr);
+}
+
+static void mempool_numa_destroy(struct mempool_numa *np)
+{
+    int node;
+
+    if (!np)
+        return;
+
+    for (node = 0; node < np->nr_nodes; node++) {
+        mempool_destroy(np->pools[node]);
+        mempool_arena_destroy(np->arenas[node]);
+    }
+    free(np);
+}
+
+/* Scaling benchmark */
+struct bench_arg {
+    struct mempool *pool;
+    bool cached;
+    unsigned long ops;
+    unsigned long failures;
 };
 
-/* Helper functions */
-static void *mempool_alloc_node(size_t size)
+static void *bench_thread(void *data)
 {
-    return malloc(size);
+    struct bench_arg *arg = data;
+    unsigned long i;
+    void *ptr;
+
+    for (i = 0; i < arg->ops; i++) {
+        ptr = arg->cached ? mempool_cache_alloc(arg->pool) :
+                            mempool_alloc(arg->pool);
+        if (!ptr) {
+            arg->failures++;
+            continue;
+        }
+        *(volatile unsigned long *)ptr = i;
+        if (arg->cached)
+            mempool_cache_free(arg->pool, ptr);
+        else
+            mempool_free(arg->pool, ptr);
+    }
+    return NULL;
 }
 
-static void mempool_free_node(void *ptr)
+static double now_sec(void)
 {
-    free(ptr);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-/* Initialize memory pool */
-static struct mempool *mempool_create(
-    size_t min_nr,
-    size_t elem_size,
-    void *(*alloc)(size_t),
-    void (*free)(void *))
+/* Run BENCH_OPS alloc/free pairs split across nr_threads; returns Mops/s */
+static double run_bench(bool cached, int nr_threads, unsigned long *failures)
 {
+    pthread_t threads[BENCH_MAX_THREADS];
+    struct bench_arg args[BENCH_MAX_THREADS];
     struct mempool *pool;
-    size_t i;
-
-    if (!min_nr || !elem_size)
-        return NULL;
+    double start, elapsed;
+    int i;
 
-    pool = malloc(sizeof(*pool));
+    *failures = 0;
+    pool = mempool_create(MEMPOOL_INIT_SIZE, TEST_ELEM_SIZE, NULL, NULL, NULL);
     if (!pool)
-        return NULL;
-
-    pool->min_nr = min_nr;
-    pool->curr_nr = 0;
-    pool->elem_size = elem_size;
-    pool->elements = NULL;
-    pool->alloc = alloc ? alloc : mempool_alloc_node;
-    pool->free = free ? free : mempool_free_node;
+        return 0;
+    if (cached && mempool_magazine_init(pool, MEMPOOL_MAG_SIZE) != 0) {
+        mempool_destroy(pool);
+        return 0;
+    }
+    /* Uncapped so the benchmark measures the lock, not exhaustion */
+    pool->max_nr = SIZE_MAX;
 
-    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
-        free(pool);
-        return NULL;
+    start = now_sec();
+    for (i = 0; i < nr_threads; i++) {
+        args[i].pool = pool;
+        args[i].cached = cached;
+        args[i].ops = BENCH_OPS / nr_threads;
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+        *failures += args[i].failures;
     }
+    elapsed = now_sec() - start;
 
-    /* Pre-allocate minimum number of elements */
-    for (i = 0; i < min_nr; i++) {
-        struct mempool_element *elem = malloc(sizeof(*elem));
-        if (!elem)
-            goto cleanup;
+    mempool_destroy(pool);
 
-        elem->ptr = pool->alloc(elem_size);
-        if (!elem->ptr) {
-            free(elem);
-            goto cleanup;
-        }
+    return (double)BENCH_OPS / elapsed / 1e6;
+}
 
-        elem->next = pool->elements;
-        pool->elements = elem;
-        pool->curr_nr++;
+/* Slab versus glibc malloc: bytes per object and alloc/free throughput */
+static void bench_slab(size_t size)
+{
+    const int rounds = 16;
+    struct kmem_cache *cache;
+    struct mallinfo2 before, after;
+    double start, slab_mops, malloc_mops;
+    size_t slab_bytes, malloc_bytes;
+    unsigned long i;
+    void **objs;
+    int r;
+
+    objs = malloc(BENCH_SLAB_OBJS * sizeof(*objs));
+    cache = kmem_cache_create("bench", size, 0, NULL);
+    if (!objs || !cache) {
+        free(objs);
+        kmem_cache_destroy(cache);
+        return;
     }
 
-    return pool;
+    /* Footprint of BENCH_SLAB_OBJS live objects */
+    before = mallinfo2();
+    for (i = 0; i < BENCH_SLAB_OBJS; i++)
+        objs[i] = malloc(size);
+    after = mallinfo2();
+    malloc_bytes = after.uordblks - before.uordblks;
+    for (i = 0; i < BENCH_SLAB_OBJS; i++)
+        free(objs[i]);
 
-cleanup:
-    while (pool->elements) {
-        struct mempool_element *elem = pool->elements;
-        pool->elements = elem->next;
-        pool->free(elem->ptr);
-        free(elem);
+    for (i = 0; i < BENCH_SLAB_OBJS; i++)
+        objs[i] = kmem_cache_alloc(cache);
+    slab_bytes = cache->nr_slabs * cache->slab_size;
+    for (i = 0; i < BENCH_SLAB_OBJS; i++)
+        kmem_cache_free(cache, objs[i]);
+
+    start = now_sec();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < BENCH_SLAB_OBJS; i++)
+            objs[i] = malloc(size);
+        for (i = 0; i < BENCH_SLAB_OBJS; i++)
+            free(objs[i]);
     }
-    pthread_mutex_destroy(&pool->lock);
-    free(pool);
-    return NULL;
+    malloc_mops = rounds * BENCH_SLAB_OBJS / (now_sec() - start) / 1e6;
+
+    start = now_sec();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < BENCH_SLAB_OBJS; i++)
+            objs[i] = kmem_cache_alloc(cache);
+        for (i = 0; i < BENCH_SLAB_OBJS; i++)
+            kmem_cache_free(cache, objs[i]);
+    }
+    slab_mops = rounds * BENCH_SLAB_OBJS / (now_sec() - start) / 1e6;
+
+    printf("%6zu %12.1f %12.1f %13.2f %13.2f\n", size,
+           (double)malloc_bytes / BENCH_SLAB_OBJS,
+           (double)slab_bytes / BENCH_SLAB_OBJS, malloc_mops, slab_mops);
+
+    kmem_cache_destroy(cache);
+    free(objs);
 }
 
-/* Allocate element from pool */
-static void *mempool_alloc(struct mempool *pool)
+/* Per-element versus bulk alloc/free in batches of the given size */
+static void bench_bulk(struct mempool *pool, size_t batch)
 {
-    struct mempool_element *elem;
-    void *ptr = NULL;
+    void *ptrs[256];
+    double start, single_mops, bulk_mops;
+    unsigned long done;
+    size_t i;
 
-    if (!pool)
-        return NULL;
+    start = now_sec();
+    for (done = 0; done < BENCH_OPS; done += batch) {
+        for (i = 0; i < batch; i++)
+            ptrs[i] = mempool_alloc(pool);
+        for (i = 0; i < batch; i++)
+            mempool_free(pool, ptrs[i]);
+    }
+    single_mops = done / (now_sec() - start) / 1e6;
 
-    pthread_mutex_lock(&pool->lock);
+    start = now_sec();
+    for (done = 0; done < BENCH_OPS; done += batch) {
+        i = mempool_alloc_bulk(pool, ptrs, batch);
+        mempool_free_bulk(pool, ptrs, i);
+    }
+    bulk_mops = done / (now_sec() - start) / 1e6;
 
-    if (pool->elements) {
-        /* Get element from pool */
-        elem = pool->elements;
-        pool->elements = elem->next;
-        ptr = elem->ptr;
-        free(elem);
-        pool->curr_nr--;
-    } else if (pool->curr_nr < MEMPOOL_MAX_SIZE) {
-        /* Allocate new element */
-        ptr = pool->alloc(pool->elem_size);
-        if (ptr)
-            pool->curr_nr++;
+    printf("%6zu %15.2f %13.2f\n", batch, single_mops, bulk_mops);
+}
+
+/* Alloc latency under oversubscription, mutex pool versus lock-free pool */
+struct lat_arg {
+    struct mempool *pool;
+    struct mempool_lf *lf_pool;
+    uint64_t *samples;       /* BENCH_LAT_SAMPLES alloc latencies in ns */
+    unsigned long failures;
+};
+
+static void *lat_thread(void *data)
+{
+    struct lat_arg *arg = data;
+    uint64_t start;
+    void *ptr;
+    int i;
+
+    for (i = 0; i < BENCH_LAT_SAMPLES; i++) {
+        start = now_ns();
+        ptr = arg->lf_pool ? mempool_lf_alloc(arg->lf_pool) :
+                             mempool_alloc(arg->pool);
+        arg->samples[i] = now_ns() - start;
+        if (!ptr) {
+            arg->failures++;
+            continue;
+        }
+        if (arg->lf_pool)
+            mempool_lf_free(arg->lf_pool, ptr);
+        else
+            mempool_free(arg->pool, ptr);
     }
+    return NULL;
+}
 
-    pthread_mutex_unlock(&pool->lock);
-    return ptr;
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
 }
 
-/* Return element to pool */
-static void mempool_free(struct mempool *pool, void *ptr)
+static void bench_latency(bool lock_free, int nr_threads)
 {
-    struct mempool_element *elem;
+    pthread_t threads[BENCH_MAX_THREADS];
+    struct lat_arg args[BENCH_MAX_THREADS];
+    size_t nr_samples = (size_t)nr_threads * BENCH_LAT_SAMPLES;
+    struct mempool_lf *lf_pool = NULL;
+    struct mempool *pool = NULL;
+    unsigned long failures = 0;
+    uint64_t *samples;
+    int i;
 
-    if (!pool || !ptr)
+    samples = malloc(nr_samples * sizeof(*samples));
+    if (!samples)
         return;
 
-    pthread_mutex_lock(&pool->lock);
-
-    if (pool->curr_nr < pool->min_nr) {
-        /* Add back to pool */
-        elem = malloc(sizeof(*elem));
-        if (elem) {
-            elem->ptr = ptr;
-            elem->next = pool->elements;
-            pool->elements = elem;
-            pool->curr_nr++;
-            ptr = NULL;
-        }
+    /* Reserve sized for every thread, backing allocator capped off */
+    if (lock_free) {
+        lf_pool = mempool_lf_create(nr_threads, TEST_ELEM_SIZE, NULL, NULL, NULL);
+        if (lf_pool)
+            lf_pool->max_nr = nr_threads;
+    } else {
+        pool = mempool_create(nr_threads, TEST_ELEM_SIZE, NULL, NULL, NULL);
+        if (pool)
+            pool->max_nr = nr_threads;
+    }
+    if (!pool && !lf_pool) {
+        free(samples);
+        return;
     }
 
-    if (ptr) {
-        /* Free if pool is full */
-        pool->free(ptr);
+    for (i = 0; i < nr_threads; i++) {
+        args[i].pool = pool;
+        args[i].lf_pool = lf_pool;
+        args[i].samples = samples + (size_t)i * BENCH_LAT_SAMPLES;
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, lat_thread, &args[i]);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
     }
 
-    pthread_mutex_unlock(&pool->lock);
+    qsort(samples, nr_samples, sizeof(*samples), cmp_u64);
+    printf("%-10s %8d %10llu %10llu %10llu %9lu\n",
+           lock_free ? "lock-free" : "mutex", nr_threads,
+           (unsigned long long)samples[nr_samples / 2],
+           (unsigned long long)samples[nr_samples * 99 / 100],
+           (unsigned long long)samples[nr_samples * 999 / 1000], failures);
+
+    mempool_lf_destroy(lf_pool);
+    mempool_destroy(pool);
+    free(samples);
 }
 
-/* Destroy memory pool */
-static void mempool_destroy(struct mempool *pool)
+/* Open a dTLB read-miss counter for this thread, -1 if unavailable */
+static int perf_open_dtlb(void)
 {
-    if (!pool)
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Allocate BENCH_ARENA_OBJS elements, touch them in random order and free
+ * them, reporting throughput and dTLB misses of the access phase.
+ */
+static void bench_arena(const char *label, struct mempool *pool)
+{
+    double start, alloc_mops, access_mops;
+    unsigned long i, j, sum = 0;
+    uint64_t misses = 0;
+    void **objs;
+    int fd;
+
+    objs = malloc(BENCH_ARENA_OBJS * sizeof(*objs));
+    if (!objs)
         return;
 
-    pthread_mutex_lock(&pool->lock);
+    start = now_sec();
+    for (i = 0; i < BENCH_ARENA_OBJS; i++) {
+        objs[i] = mempool_alloc(pool);
+        if (objs[i])
+            *(unsigned long *)objs[i] = i;
+    }
+    alloc_mops = BENCH_ARENA_OBJS / (now_sec() - start) / 1e6;
 
-    while (pool->elements) {
-        struct mempool_element *elem = pool->elements;
-        pool->elements = elem->next;
-        pool->free(elem->ptr);
-        free(elem);
+    /* Shuffle so the access phase is TLB-bound */
+    srand(1);
+    for (i = BENCH_ARENA_OBJS - 1; i > 0; i--) {
+        void *tmp;
+
+        j = (unsigned long)rand() % (i + 1);
+        tmp = objs[i];
+        objs[i] = objs[j];
+        objs[j] = tmp;
     }
 
-    pthread_mutex_unlock(&pool->lock);
-    pthread_mutex_destroy(&pool->lock);
-    free(pool);
+    fd = perf_open_dtlb();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = now_sec();
+    for (i = 0; i < BENCH_ARENA_OBJS; i++) {
+        if (objs[i])
+            sum += *(volatile unsigned long *)objs[i];
+    }
+    access_mops = BENCH_ARENA_OBJS / (now_sec() - start) / 1e6;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+        close(fd);
+    }
+
+    for (i = 0; i < BENCH_ARENA_OBJS; i++)
+        mempool_free(pool, objs[i]);
+
+    if (fd >= 0)
+        printf("%-16s %12.2f %13.2f %12llu\n", label, alloc_mops,
+               access_mops, (unsigned long long)misses);
+    else
+        printf("%-16s %12.2f %13.2f %12s\n", label, alloc_mops,
+               access_mops, "n/a");
+    (void)sum;
+    free(objs);
 }
 
-/* Print pool statistics */
-static void print_pool_stats(struct mempool *pool)
+/* Backing allocator that can be made to fail on demand */
+static bool backing_fail;
+
+static void *flaky_alloc(size_t size, void *pool_data)
 {
-    if (!pool)
-        return;
+    (void)pool_data;
+    return backing_fail ? NULL : malloc(size);
+}
+
+/* Number of threads sleeping in mempool_alloc_wait() */
+static int mempool_nr_waiters(struct mempool *pool)
+{
+    struct mempool_waiter *w;
+    int nr = 0;
 
     pthread_mutex_lock(&pool->lock);
-    printf("\nMempool Statistics:\n");
-    printf("Minimum elements: %zu\n", pool->min_nr);
-    printf("Current elements: %zu\n", pool->curr_nr);
-    printf("Element size: %zu bytes\n", pool->elem_size);
+    for (w = pool->wait_head; w; w = w->next)
+        nr++;
     pthread_mutex_unlock(&pool->lock);
+    return nr;
+}
+
+struct waiter_arg {
+    struct mempool *pool;
+    int id;
+    void *ptr;
+};
+
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_order[MEMPOOL_INIT_SIZE];
+static int wake_count;
+
+static void *waiter_thread(void *data)
+{
+    struct waiter_arg *arg = data;
+
+    arg->ptr = mempool_alloc_wait(arg->pool, -1);
+    pthread_mutex_lock(&wake_lock);
+    wake_order[wake_count++] = arg->id;
+    pthread_mutex_unlock(&wake_lock);
+    return NULL;
 }
 
 /* Test structure */
@@ -195,17 +2189,27 @@ struct test_struct {
     char data[TEST_ELEM_SIZE - sizeof(int)];
 };
 
+/* Slab constructor: state survives free and reallocation */
+static void test_struct_ctor(void *obj)
+{
+    struct test_struct *ts = obj;
+
+    ts->id = -1;
+    snprintf(ts->data, sizeof(ts->data), "constructed");
+}
+
 int main()
 {
     struct mempool *pool;
     struct test_struct *elements[MEMPOOL_MAX_SIZE];
+    unsigned long depot_ops;
     int i;
 
     printf("Memory Pool Test Program\n");
     printf("=======================\n\n");
 
     /* Create memory pool */
-    pool = mempool_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct), NULL, NULL);
+    pool = mempool_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct), NULL, NULL, NULL);
     if (!pool) {
         printf("Failed to create memory pool\n");
         return -1;
@@ -260,6 +2264,9 @@ int main()
     void *overflow = mempool_alloc(pool);
     if (!overflow) {
         printf("Successfully prevented overflow allocation\n");
+    } else {
+        printf("Overflow allocation served from reserve\n");
+        mempool_free(pool, overflow);
     }
     print_pool_stats(pool);
 
@@ -280,5 +2287,358 @@ int main()
     mempool_destroy(pool);
     printf("Memory pool destroyed\n");
 
+    /* Test 6: Per-thread magazines */
+    printf("\nTest 6: Per-thread magazines\n");
+    printf("----------------------------\n");
+    pool = mempool_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct), NULL, NULL, NULL);
+    if (!pool || mempool_magazine_init(pool, MEMPOOL_MAG_SIZE) != 0) {
+        printf("Failed to create magazine pool\n");
+        mempool_destroy(pool);
+        return -1;
+    }
+    for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+        elements[i] = mempool_cache_alloc(pool);
+        if (elements[i])
+            elements[i]->id = i;
+    }
+    for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+        mempool_cache_free(pool, elements[i]);
+        elements[i] = NULL;
+    }
+    /* Second round is served entirely from the thread's magazines */
+    depot_ops = depot_lock_ops(pool);
+    for (i = 0; i < MEMPOOL_MAX_SIZE; i++)
+        elements[i] = mempool_cache_alloc(pool);
+    for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+        mempool_cache_free(pool, elements[i]);
+        elements[i] = NULL;
+    }
+    printf("Second round without the depot lock: %s\n",
+           depot_lock_ops(pool) == depot_ops ? "yes" : "no");
+    print_depot_stats(pool);
+    mempool_magazine_flush(pool);
+    print_depot_stats(pool);
+    mempool_destroy(pool);
+
+    /* Test 7: Blocking allocation with guaranteed reserve */
+    printf("\nTest 7: Blocking allocation with guaranteed reserve\n");
+    printf("-------------------------------------------------\n");
+    {
+        struct waiter_arg wargs[3];
+        pthread_t wthreads[3];
+        void *held[3];
+        struct timespec ts = {0, 1000000}; /* 1ms */
+
+        pool = mempool_create(2, sizeof(struct test_struct), flaky_alloc, NULL, NULL);
+        if (!pool) {
+            printf("Failed to create reserve pool\n");
+            return -1;
+        }
+
+        held[0] = mempool_alloc(pool);
+        backing_fail = true;
+        printf("Backing allocator disabled\n");
+        held[1] = mempool_alloc(pool);
+        held[2] = mempool_alloc(pool);
+        printf("Reserve served 2 allocations: %s\n",
+               held[1] && held[2] && pool->curr_nr == 0 ? "yes" : "no");
+        printf("Non-blocking alloc on empty reserve: %s\n",
+               mempool_alloc(pool) ? "succeeded" : "NULL");
+        printf("Blocking alloc with 20ms timeout: %s\n",
+               mempool_alloc_wait(pool, 20) ? "succeeded" : "timed out");
+
+        for (i = 0; i < 3; i++) {
+            wargs[i].pool = pool;
+            wargs[i].id = i;
+            wargs[i].ptr = NULL;
+            pthread_create(&wthreads[i], NULL, waiter_thread, &wargs[i]);
+            /* Start the next waiter only once this one is queued */
+            while (mempool_nr_waiters(pool) != i + 1)
+                nanosleep(&ts, NULL);
+        }
+        printf("Waiters queued: %d\n", mempool_nr_waiters(pool));
+
+        for (i = 0; i < 3; i++)
+            mempool_free(pool, held[i]);
+        for (i = 0; i < 3; i++)
+            pthread_join(wthreads[i], NULL);
+
+        printf("Wake order: %d %d %d (%s)\n", wake_order[0], wake_order[1],
+               wake_order[2], wake_order[0] == 0 && wake_order[1] == 1 &&
+               wake_order[2] == 2 ? "FIFO" : "unfair");
+
+        for (i = 0; i < 3; i++)
+            mempool_free(pool, wargs[i].ptr);
+        backing_fail = false;
+        print_pool_stats(pool);
+        mempool_destroy(pool);
+    }
+
+    /* Test 8: Slab cache backend */
+    printf("\nTest 8: Slab cache backend\n");
+    printf("--------------------------\n");
+    {
+        struct kmem_cache *cache;
+        bool constructed = true;
+
+        cache = kmem_cache_create("test_struct", sizeof(struct test_struct),
+                                  0, test_struct_ctor);
+        pool = cache ? mempool_create_slab_pool(MEMPOOL_INIT_SIZE, cache) : NULL;
+        if (!pool) {
+            printf("Failed to create slab-backed pool\n");
+            kmem_cache_destroy(cache);
+            return -1;
+        }
+
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            elements[i] = mempool_alloc(pool);
+            if (!elements[i] || elements[i]->id != -1)
+                constructed = false;
+        }
+        printf("All objects constructed: %s\n", constructed ? "yes" : "no");
+        print_cache_stats(cache);
+
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            mempool_free(pool, elements[i]);
+            elements[i] = NULL;
+        }
+        mempool_destroy(pool);
+        kmem_cache_shrink(cache);
+        print_cache_stats(cache);
+        kmem_cache_destroy(cache);
+    }
+
+    /* Test 9: Bulk allocation and free */
+    printf("\nTest 9: Bulk allocation and free\n");
+    printf("--------------------------------\n");
+    {
+        void *ptrs[MEMPOOL_MAX_SIZE + 4];
+        size_t got;
+
+        pool = mempool_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct),
+                              NULL, NULL, NULL);
+        if (!pool) {
+            printf("Failed to create bulk pool\n");
+            return -1;
+        }
+
+        got = mempool_alloc_bulk(pool, ptrs, MEMPOOL_MAX_SIZE + 4);
+        printf("Requested %d elements, got %zu (limit %d)\n",
+               MEMPOOL_MAX_SIZE + 4, got, MEMPOOL_MAX_SIZE);
+        print_pool_stats(pool);
+
+        mempool_free_bulk(pool, ptrs, got);
+        printf("Freed %zu elements in one call\n", got);
+        print_pool_stats(pool);
+        mempool_destroy(pool);
+    }
+
+    /* Test 10: Lock-free pool */
+    printf("\nTest 10: Lock-free pool\n");
+    printf("-----------------------\n");
+    {
+        struct mempool_lf *lf_pool;
+        void *extra;
+
+        lf_pool = mempool_lf_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct),
+                                    flaky_alloc, NULL, NULL);
+        if (!lf_pool) {
+            printf("Failed to create lock-free pool\n");
+            return -1;
+        }
+
+        backing_fail = true;
+        for (i = 0; i < MEMPOOL_INIT_SIZE; i++)
+            elements[i] = mempool_lf_alloc(lf_pool);
+        extra = mempool_lf_alloc(lf_pool);
+        printf("Reserve served %zu allocations, next alloc: %s\n",
+               MEMPOOL_INIT_SIZE - atomic_load(&lf_pool->curr_nr),
+               extra ? "succeeded" : "NULL");
+        backing_fail = false;
+
+        for (i = 0; i < MEMPOOL_INIT_SIZE; i++) {
+            mempool_lf_free(lf_pool, elements[i]);
+            elements[i] = NULL;
+        }
+        printf("Reserve refilled: %zu of %zu\n",
+               atomic_load(&lf_pool->curr_nr), lf_pool->min_nr);
+        mempool_lf_destroy(lf_pool);
+    }
+
+    /* Test 11: Arena-backed and NUMA-local pools */
+    printf("\nTest 11: Arena-backed and NUMA-local pools\n");
+    printf("-----------------------------------------\n");
+    {
+        struct mempool_numa *np;
+
+        np = mempool_numa_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct),
+                                 MEMPOOL_MAX_SIZE, ARENA_HUGETLB);
+        if (!np) {
+            printf("Failed to create NUMA pools\n");
+            return -1;
+        }
+
+        printf("Nodes: %d, current node: %d\n", np->nr_nodes,
+               numa_current_node());
+        printf("Node 0 arena: %zu elements of %zu bytes in %zu KB, %s\n",
+               np->arenas[0]->nr_elems, np->arenas[0]->stride,
+               np->arenas[0]->map_size >> 10,
+               np->arenas[0]->hugetlb ? "hugetlb" : "THP advised");
+
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            elements[i] = mempool_numa_alloc(np);
+            if (elements[i])
+                elements[i]->id = i;
+        }
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            if (!elements[i] || !arena_contains(np->arenas[0], elements[i]))
+                break;
+        }
+        if (np->nr_nodes == 1)
+            printf("Allocated %d elements from the node 0 arena: %s\n",
+                   MEMPOOL_MAX_SIZE, i == MEMPOOL_MAX_SIZE ? "yes" : "no");
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            mempool_numa_free(np, elements[i]);
+            elements[i] = NULL;
+        }
+        {
+            struct test_struct stray;
+
+            mempool_numa_free(np, &stray);
+            printf("Foreign pointer rejected: %s\n",
+                   atomic_load(&np->bad_frees) == 1 ? "yes" : "no");
+        }
+        print_pool_stats(np->pools[0]);
+        mempool_numa_destroy(np);
+    }
+
+    /* Test 12: Usage telemetry */
+    printf("\nTest 12: Usage telemetry\n");
+    printf("------------------------\n");
+    {
+        pthread_t threads[4];
+        struct bench_arg args[4];
+
+        pool = mempool_create(MEMPOOL_INIT_SIZE, sizeof(struct test_struct),
+                              flaky_alloc, NULL, NULL);
+        if (!pool) {
+            printf("Failed to create telemetry pool\n");
+            return -1;
+        }
+
+        /* Backing allocator serves the first half, then runs dry */
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            if (i == MEMPOOL_MAX_SIZE / 2)
+                backing_fail = true;
+            elements[i] = mempool_alloc(pool);
+        }
+        backing_fail = false;
+        for (i = 0; i < MEMPOOL_MAX_SIZE; i++) {
+            mempool_free(pool, elements[i]);
+            elements[i] = NULL;
+        }
+        print_pool_telemetry("test", pool);
+
+        /* Four threads hammering the lock */
+        mempool_reset_stats(pool);
+        for (i = 0; i < 4; i++) {
+            args[i].pool = pool;
+            args[i].cached = false;
+            args[i].ops = BENCH_OPS / 16;
+            args[i].failures = 0;
+            pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+        }
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], NULL);
+        print_pool_telemetry("test (contended)", pool);
+        mempool_destroy(pool);
+    }
+
+    /* Benchmark 1: Magazine scaling */
+    printf("\nBenchmark 1: Magazine scaling (%lu alloc/free pairs)\n", BENCH_OPS);
+    printf("--------------------------------------------------\n");
+    printf("%8s %14s %15s %10s\n", "threads", "locked Mops/s", "magazine Mops/s", "failures");
+    for (i = 1; i <= BENCH_MAX_THREADS; i *= 2) {
+        unsigned long locked_fail, cached_fail;
+        double locked = run_bench(false, i, &locked_fail);
+        double cached = run_bench(true, i, &cached_fail);
+        printf("%8d %14.2f %15.2f %10lu\n", i, locked, cached,
+               locked_fail + cached_fail);
+    }
+
+    /* Benchmark 2: Slab cache versus malloc */
+    printf("\nBenchmark 2: Slab cache versus malloc (%lu objects)\n",
+           BENCH_SLAB_OBJS);
+    printf("-------------------------------------------------\n");
+    printf("%6s %12s %12s %13s %13s\n", "size", "malloc B/obj",
+           "slab B/obj", "malloc Mops/s", "slab Mops/s");
+    bench_slab(32);
+    bench_slab(64);
+    bench_slab(192);
+    bench_slab(512);
+
+    /* Benchmark 3: Bulk versus per-element on a slab-backed pool */
+    printf("\nBenchmark 3: Bulk versus per-element (%lu elements)\n", BENCH_OPS);
+    printf("-------------------------------------------------\n");
+    {
+        struct kmem_cache *cache;
+
+        cache = kmem_cache_create("bulk", TEST_ELEM_SIZE, 0, NULL);
+        pool = cache ? mempool_create_slab_pool(MEMPOOL_INIT_SIZE, cache) : NULL;
+        if (pool) {
+            pool->max_nr = SIZE_MAX;
+            printf("%6s %15s %13s\n", "batch", "single Mops/s", "bulk Mops/s");
+            bench_bulk(pool, 32);
+            bench_bulk(pool, 64);
+            bench_bulk(pool, 128);
+            bench_bulk(pool, 256);
+            mempool_destroy(pool);
+        }
+        kmem_cache_destroy(cache);
+    }
+
+    /* Benchmark 4: Alloc latency under oversubscription */
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int nr_threads = (cpus > 0 ? cpus : 1) * BENCH_LAT_OVERSUB;
+
+        if (nr_threads > BENCH_MAX_THREADS)
+            nr_threads = BENCH_MAX_THREADS;
+
+        printf("\nBenchmark 4: Alloc latency, %d threads on %ld CPUs\n",
+               nr_threads, cpus);
+        printf("-------------------------------------------------\n");
+        printf("%-10s %8s %10s %10s %10s %9s\n", "pool", "threads",
+               "p50 ns", "p99 ns", "p99.9 ns", "failures");
+        bench_latency(false, nr_threads);
+        bench_latency(true, nr_threads);
+    }
+
+    /* Benchmark 5: malloc versus arena backing */
+    printf("\nBenchmark 5: malloc versus arena backing (%lu elements)\n",
+           BENCH_ARENA_OBJS);
+    printf("------------------------------------------------------\n");
+    printf("%-16s %12s %13s %12s\n", "backing", "alloc Mops/s",
+           "access Mops/s", "dTLB misses");
+    {
+        struct mempool_arena *arena;
+
+        pool = mempool_create(MEMPOOL_INIT_SIZE, TEST_ELEM_SIZE, NULL, NULL, NULL);
+        if (pool) {
+            pool->max_nr = SIZE_MAX;
+            bench_arena("malloc", pool);
+            mempool_destroy(pool);
+        }
+
+        arena = mempool_arena_create(BENCH_ARENA_OBJS, TEST_ELEM_SIZE, -1,
+                                     ARENA_HUGETLB);
+        pool = arena ? mempool_create_arena_pool(MEMPOOL_INIT_SIZE, arena) : NULL;
+        if (pool) {
+            bench_arena(arena->hugetlb ? "arena (hugetlb)" : "arena (THP)", pool);
+            mempool_destroy(pool);
+        }
+        mempool_arena_destroy(arena);
+    }
+
     return 0;
 }
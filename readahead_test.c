@@ -12,22 +12,59 @@
 #define MAX_READAHEAD   (PAGE_SIZE * 32)
 #define MIN_READAHEAD   (PAGE_SIZE * 2)
 #define MAX_FILE_SIZE   (PAGE_SIZE * PAGE_CACHE_SIZE)
+#define MAX_RA_PAGES    (MAX_READAHEAD / PAGE_SIZE)
+#define RA_WORKERS      4
+#define RA_STRIDE_DEPTH 4               /* Strided requests fetched ahead */
+#define RA_NO_PAGE      (~0UL)
 
 /* Structure definitions */
 struct page {
     unsigned long index;     /* Page index in file */
     unsigned char *data;     /* Page data */
     bool uptodate;          /* Page is valid */
-    pthread_mutex_t lock;    /* Page lock */
+    pthread_mutex_t lock;    /* Page lock, held for the duration of I/O */
+    bool readahead;          /* PG_readahead: start the next window here */
+    int pins;                /* Queued readahead I/O, under file->lock */
+};
+
+/* Access pattern of one reader, as seen by its readahead state */
+enum ra_pattern {
+    RA_RANDOM,
+    RA_SEQUENTIAL,
+    RA_BACKWARD,
+    RA_STRIDE,
+};
+
+static const char *const ra_pattern_names[] = {
+    "random", "sequential", "backward", "strided",
+};
+
+/*
+ * Per-reader readahead state. Each reader of a file keeps its own, so
+ * interleaved streams do not reset each other's windows.
+ */
+struct file_ra_state {
+    unsigned long start;                /* First page of current window */
+    unsigned long size;                 /* Current readahead window size */
+    unsigned long async_size;           /* Window pages left at the marker */
+    unsigned long prev_start;           /* First page of the last request */
+    unsigned long prev_index;           /* Last page of the last request */
+    long stride;                        /* prev_start delta between requests */
+    enum ra_pattern pattern;            /* Pattern of the recent requests */
+    unsigned int hits;                  /* Consecutive requests matching it */
 };
 
 struct file {
     char *name;                         /* File name */
     unsigned long size;                 /* File size */
-    unsigned long ra_pages;             /* Current readahead window size */
+    struct file_ra_state ra;            /* State for read_file() */
     unsigned long pos;                  /* Current read position */
     struct page *page_cache[PAGE_CACHE_SIZE]; /* Page cache */
     pthread_mutex_t lock;               /* File lock */
+    pthread_cond_t io_done;             /* Signalled as readahead I/O completes */
+    unsigned long io_pending;           /* Readahead pages queued or in flight */
+    unsigned long nr_sync_pages;        /* Pages the reader had to read itself */
+    unsigned long nr_async_pages;       /* Pages read by the I/O workers */
 };
 
 struct readahead_control {
@@ -37,9 +74,27 @@ struct readahead_control {
     unsigned long async_size;/* Asynchronous readahead size */
 };
 
+/* Readahead I/O queued for the background workers */
+struct ra_work {
+    struct file *file;
+    struct page *page;
+    struct ra_work *next;
+};
+
 /* Global variables */
 static unsigned char simulated_disk[MAX_FILE_SIZE];
 
+static struct {
+    pthread_t threads[RA_WORKERS];
+    struct ra_work *head, *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+} ra_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
 /* Helper functions */
 static struct page *alloc_page(void)
 {
@@ -60,6 +115,8 @@ static struct page *alloc_page(void)
     }
 
     page->uptodate = false;
+    page->readahead = false;
+    page->pins = 0;
     return page;
 }
 
@@ -72,7 +129,11 @@ static void free_page(struct page *page)
     free(page);
 }
 
-/* Simulated disk I/O */
+/*
+ * Simulated disk I/O. The page lock is held while the read is in flight,
+ * so a second caller waits for it and then finds the page up to date.
+ * Returns 1 if this call read the page, 0 if it already was up to date.
+ */
 static int read_from_disk(struct file *file, struct page *page)
 {
     unsigned long offset = page->index * PAGE_SIZE;
@@ -81,6 +142,10 @@ static int read_from_disk(struct file *file, struct page *page)
         return -EINVAL;
 
     pthread_mutex_lock(&page->lock);
+    if (page->uptodate) {
+        pthread_mutex_unlock(&page->lock);
+        return 0;
+    }
     
     /* Simulate I/O delay */
     struct timespec ts = {0, 10000000}; /* 10ms */
@@ -97,10 +162,22 @@ static int read_from_disk(struct file *file, struct page *page)
     page->uptodate = true;
     pthread_mutex_unlock(&page->lock);
     
-    return 0;
+    return 1;
 }
 
 /* Page cache operations */
+static struct page *find_get_page(struct file *file, unsigned long index)
+{
+    struct page *page;
+
+    pthread_mutex_lock(&file->lock);
+    page = file->page_cache[index % PAGE_CACHE_SIZE];
+    if (page && page->index != index)
+        page = NULL;
+    pthread_mutex_unlock(&file->lock);
+    return page;
+}
+
 static struct page *find_or_create_page(struct file *file, unsigned long index)
 {
     pthread_mutex_lock(&file->lock);
@@ -113,6 +190,18 @@ static struct page *find_or_create_page(struct file *file, unsigned long index)
         return page;
     }
     
+    /* A page with readahead I/O queued cannot go until the I/O is done */
+    while (file->page_cache[index % PAGE_CACHE_SIZE] &&
+           file->page_cache[index % PAGE_CACHE_SIZE]->pins)
+        pthread_cond_wait(&file->io_done, &file->lock);
+
+    if (file->page_cache[index % PAGE_CACHE_SIZE] &&
+        file->page_cache[index % PAGE_CACHE_SIZE]->index == index) {
+        struct page *page = file->page_cache[index % PAGE_CACHE_SIZE];
+        pthread_mutex_unlock(&file->lock);
+        return page;
+    }
+
     /* Create new page */
     struct page *page = alloc_page();
     if (!page) {
@@ -132,39 +221,317 @@ static struct page *find_or_create_page(struct file *file, unsigned long index)
     return page;
 }
 
+/* Background readahead I/O */
+static void *ra_worker_fn(void *arg)
+{
+    struct ra_work *work;
+    int ret;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&ra_queue.lock);
+        while (!ra_queue.head && !ra_queue.stop)
+            pthread_cond_wait(&ra_queue.wake, &ra_queue.lock);
+        work = ra_queue.head;
+        if (!work) {
+            pthread_mutex_unlock(&ra_queue.lock);
+            return NULL;
+        }
+        ra_queue.head = work->next;
+        if (!ra_queue.head)
+            ra_queue.tail = NULL;
+        pthread_mutex_unlock(&ra_queue.lock);
+
+        ret = read_from_disk(work->file, work->page);
+
+        pthread_mutex_lock(&work->file->lock);
+        if (ret > 0)
+            work->file->nr_async_pages++;
+        work->page->pins--;
+        work->file->io_pending--;
+        pthread_cond_broadcast(&work->file->io_done);
+        pthread_mutex_unlock(&work->file->lock);
+        free(work);
+    }
+}
+
+static int ra_workers_start(void)
+{
+    for (int i = 0; i < RA_WORKERS; i++) {
+        if (pthread_create(&ra_queue.threads[i], NULL, ra_worker_fn, NULL) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Finish queued I/O and stop the workers */
+static void ra_workers_stop(void)
+{
+    pthread_mutex_lock(&ra_queue.lock);
+    ra_queue.stop = true;
+    pthread_cond_broadcast(&ra_queue.wake);
+    pthread_mutex_unlock(&ra_queue.lock);
+
+    for (int i = 0; i < RA_WORKERS; i++)
+        pthread_join(ra_queue.threads[i], NULL);
+}
+
+/* Queue a page for the workers unless it already has I/O queued */
+static void submit_page_read(struct file *file, struct page *page)
+{
+    struct ra_work *work;
+
+    pthread_mutex_lock(&file->lock);
+    if (page->pins) {
+        pthread_mutex_unlock(&file->lock);
+        return;
+    }
+    work = malloc(sizeof(*work));
+    if (!work) {
+        /* The reader falls back to reading it synchronously */
+        pthread_mutex_unlock(&file->lock);
+        return;
+    }
+    page->pins++;
+    file->io_pending++;
+    pthread_mutex_unlock(&file->lock);
+
+    work->file = file;
+    work->page = page;
+    work->next = NULL;
+
+    pthread_mutex_lock(&ra_queue.lock);
+    if (ra_queue.tail)
+        ra_queue.tail->next = work;
+    else
+        ra_queue.head = work;
+    ra_queue.tail = work;
+    pthread_cond_signal(&ra_queue.wake);
+    pthread_mutex_unlock(&ra_queue.lock);
+}
+
 /* Readahead core functions */
+
+/*
+ * Queue I/O for the window described by ractl without waiting for it,
+ * and mark the page async_size pages before its end with PG_readahead:
+ * a reader reaching that page starts the following window, so I/O stays
+ * ahead of consumption.
+ */
 static void ondemand_readahead(struct readahead_control *ractl)
 {
     unsigned long index = ractl->start;
     unsigned long nr_pages = ractl->size;
     struct file *file = ractl->file;
+    unsigned long last = (file->size + PAGE_SIZE - 1) / PAGE_SIZE;
     
-    printf("Readahead: start=%lu, pages=%lu\n", index, nr_pages);
+    if (index >= last)
+        return;
+    if (nr_pages > last - index)
+        nr_pages = last - index;
+
+    printf("Readahead: start=%lu, pages=%lu, async=%lu\n",
+           index, nr_pages, ractl->async_size);
     
     /* Read pages */
     for (unsigned long i = 0; i < nr_pages; i++) {
         struct page *page = find_or_create_page(file, index + i);
         if (!page)
             continue;
-            
-        if (!page->uptodate)
-            read_from_disk(file, page);
+
+        if (ractl->async_size && i == ractl->size - ractl->async_size) {
+            pthread_mutex_lock(&file->lock);
+            page->readahead = true;
+            pthread_mutex_unlock(&file->lock);
+        }
+        submit_page_read(file, page);
     }
 }
 
-static unsigned long get_next_readahead_size(struct file *file, unsigned long current_size)
+/* Clear PG_readahead, returning whether it was set */
+static bool page_test_clear_readahead(struct file *file, struct page *page)
+{
+    bool was;
+
+    pthread_mutex_lock(&file->lock);
+    was = page->readahead;
+    page->readahead = false;
+    pthread_mutex_unlock(&file->lock);
+    return was;
+}
+
+static unsigned long get_next_readahead_size(unsigned long current_size)
 {
-    if (current_size >= MAX_READAHEAD)
-        return MAX_READAHEAD;
+    if (current_size >= MAX_RA_PAGES)
+        return MAX_RA_PAGES;
         
     current_size = current_size * 2;
     
-    if (current_size > MAX_READAHEAD)
-        current_size = MAX_READAHEAD;
+    if (current_size > MAX_RA_PAGES)
+        current_size = MAX_RA_PAGES;
         
     return current_size;
 }
 
+/* First window for a request of nr pages: the request, then as much again */
+static unsigned long get_init_ra_size(unsigned long nr)
+{
+    unsigned long size = 1;
+
+    while (size < nr)
+        size <<= 1;
+    size *= 2;
+
+    if (size < MIN_READAHEAD / PAGE_SIZE)
+        size = MIN_READAHEAD / PAGE_SIZE;
+    if (size > MAX_RA_PAGES)
+        size = MAX_RA_PAGES;
+    return size < nr ? nr : size;
+}
+
+/* Reader hit the marker: queue the window after the current one */
+static void page_cache_async_readahead(struct file *file, struct file_ra_state *ra)
+{
+    ra->start += ra->size;
+    ra->size = get_next_readahead_size(ra->size);
+    ra->async_size = ra->size;
+
+    struct readahead_control ractl = {
+        .file = file,
+        .start = ra->start,
+        .size = ra->size,
+        .async_size = ra->async_size
+    };
+    ondemand_readahead(&ractl);
+}
+
+/* Pattern the reader is confirmed to follow; random until then */
+static inline enum ra_pattern ra_confirmed_pattern(struct file_ra_state *ra)
+{
+    return ra->hits >= 2 ? ra->pattern : RA_RANDOM;
+}
+
+static void file_ra_state_init(struct file_ra_state *ra)
+{
+    ra->start = 0;
+    ra->size = 0;
+    ra->async_size = 0;
+    ra->prev_start = RA_NO_PAGE;
+    ra->prev_index = RA_NO_PAGE;
+    ra->stride = 0;
+    ra->pattern = RA_RANDOM;
+    ra->hits = 0;
+}
+
+/*
+ * Classify a request for pages [index, index + nr) against the previous
+ * one. A pattern counts as confirmed once two requests in a row follow
+ * it; a read at the start of the file is taken as sequential from the
+ * outset, as the kernel does. A request starting inside the previous
+ * one is sequential, so a stride is never 0.
+ */
+static void ra_update_pattern(struct file_ra_state *ra, unsigned long index,
+                              unsigned long nr)
+{
+    enum ra_pattern pattern = RA_RANDOM;
+    long stride = 0;
+
+    if (ra->prev_index == RA_NO_PAGE) {
+        if (index == 0)
+            pattern = RA_SEQUENTIAL;
+    } else if (index >= ra->prev_start && index <= ra->prev_index + 1) {
+        /* Continues the previous request or re-reads part of it */
+        pattern = RA_SEQUENTIAL;
+    } else if (index + nr == ra->prev_start || index + nr == ra->prev_start + 1) {
+        pattern = RA_BACKWARD;
+    } else {
+        /* Candidate stride, confirmed if the next request repeats it */
+        pattern = RA_STRIDE;
+        stride = (long)(index - ra->prev_start);
+    }
+
+    if (pattern != RA_RANDOM && pattern == ra->pattern &&
+        (pattern != RA_STRIDE || stride == ra->stride))
+        ra->hits++;
+    else
+        ra->hits = pattern == RA_SEQUENTIAL && index == 0 ? 2 : 1;
+
+    ra->pattern = pattern;
+    ra->stride = stride;
+    ra->prev_start = index;
+    ra->prev_index = index + nr - 1;
+}
+
+/*
+ * Decide what to read ahead for a request of nr pages at index, based on
+ * the reader's pattern. Only a confirmed sequential stream gets growing
+ * windows with async readahead; a confirmed backward stream reads a
+ * window behind the request, a confirmed stride fetches the next few
+ * strided requests, and anything else collapses the window to nothing.
+ */
+static void page_cache_sync_readahead(struct file *file, struct file_ra_state *ra,
+                                      unsigned long index, unsigned long nr)
+{
+    unsigned long start, size;
+
+    ra_update_pattern(ra, index, nr);
+
+    switch (ra_confirmed_pattern(ra)) {
+    case RA_SEQUENTIAL:
+        /* Still inside the window: the marker keeps it going */
+        if (find_get_page(file, index))
+            return;
+        /* Cache miss: the request plus an async tail carrying the marker */
+        ra->start = index;
+        ra->size = get_init_ra_size(nr);
+        ra->async_size = ra->size - nr;
+        break;
+
+    case RA_BACKWARD:
+        if (find_get_page(file, index))
+            return;
+        /* A window ending with the request; nothing to do asynchronously */
+        size = get_init_ra_size(nr);
+        start = index + nr > size ? index + nr - size : 0;
+        ra->start = start;
+        ra->size = index + nr - start;
+        ra->async_size = 0;
+        break;
+
+    case RA_STRIDE:
+        ra->size = 0;
+        ra->async_size = 0;
+        /* Prime the pipeline once, then add just the furthest request */
+        for (unsigned long i = ra->hits == 2 ? 1 : RA_STRIDE_DEPTH;
+             i <= RA_STRIDE_DEPTH; i++) {
+            start = index + i * ra->stride;
+            if (start >= (file->size + PAGE_SIZE - 1) / PAGE_SIZE)
+                break;
+            struct readahead_control ractl = {
+                .file = file,
+                .start = start,
+                .size = nr,
+                .async_size = 0
+            };
+            ondemand_readahead(&ractl);
+        }
+        return;
+
+    default:
+        ra->size = 0;
+        ra->async_size = 0;
+        return;
+    }
+
+    struct readahead_control ractl = {
+        .file = file,
+        .start = ra->start,
+        .size = ra->size,
+        .async_size = ra->async_size
+    };
+    ondemand_readahead(&ractl);
+}
+
 /* File operations */
 static struct file *create_test_file(const char *name, unsigned long size)
 {
@@ -174,8 +541,11 @@ static struct file *create_test_file(const char *name, unsigned long size)
         
     file->name = strdup(name);
     file->size = size;
-    file->ra_pages = MIN_READAHEAD / PAGE_SIZE;
+    file_ra_state_init(&file->ra);
     file->pos = 0;
+    file->io_pending = 0;
+    file->nr_sync_pages = 0;
+    file->nr_async_pages = 0;
     memset(file->page_cache, 0, sizeof(file->page_cache));
     
     if (pthread_mutex_init(&file->lock, NULL) != 0) {
@@ -183,51 +553,62 @@ static struct file *create_test_file(const char *name, unsigned long size)
         free(file);
         return NULL;
     }
+    if (pthread_cond_init(&file->io_done, NULL) != 0) {
+        pthread_mutex_destroy(&file->lock);
+        free(file->name);
+        free(file);
+        return NULL;
+    }
     
     return file;
 }
 
+/* Wait until no readahead I/O is queued or in flight for file */
+static void wait_for_readahead(struct file *file)
+{
+    pthread_mutex_lock(&file->lock);
+    while (file->io_pending)
+        pthread_cond_wait(&file->io_done, &file->lock);
+    pthread_mutex_unlock(&file->lock);
+}
+
 static void free_file(struct file *file)
 {
     if (!file)
         return;
+
+    /* Let queued readahead drain before the pages go away */
+    wait_for_readahead(file);
         
     for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
         if (file->page_cache[i])
             free_page(file->page_cache[i]);
     }
     
+    pthread_cond_destroy(&file->io_done);
     pthread_mutex_destroy(&file->lock);
     free(file->name);
     free(file);
 }
 
-static ssize_t read_file(struct file *file, void *buf, size_t count)
+/* Read count bytes at pos on behalf of the reader that owns ra */
+static ssize_t read_file_ra(struct file *file, struct file_ra_state *ra,
+                            void *buf, size_t count, unsigned long pos)
 {
-    if (file->pos >= file->size)
+    if (pos >= file->size)
         return 0;
         
     /* Calculate read parameters */
-    unsigned long page_index = file->pos / PAGE_SIZE;
-    unsigned long page_offset = file->pos % PAGE_SIZE;
+    unsigned long page_index = pos / PAGE_SIZE;
+    unsigned long page_offset = pos % PAGE_SIZE;
     size_t bytes_to_read = count;
     
-    if (file->pos + bytes_to_read > file->size)
-        bytes_to_read = file->size - file->pos;
+    if (pos + bytes_to_read > file->size)
+        bytes_to_read = file->size - pos;
         
-    /* Setup readahead */
-    struct readahead_control ractl = {
-        .file = file,
-        .start = page_index,
-        .size = (bytes_to_read + PAGE_SIZE - 1) / PAGE_SIZE,
-        .async_size = file->ra_pages
-    };
-    
-    /* Perform readahead */
-    ondemand_readahead(&ractl);
-    
-    /* Update readahead window */
-    file->ra_pages = get_next_readahead_size(file, file->ra_pages);
+    unsigned long nr_pages = (page_offset + bytes_to_read + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    page_cache_sync_readahead(file, ra, page_index, nr_pages);
     
     /* Copy data to user buffer */
     size_t bytes_read = 0;
@@ -235,9 +616,26 @@ static ssize_t read_file(struct file *file, void *buf, size_t count)
         struct page *page = find_or_create_page(file, page_index);
         if (!page)
             break;
-            
-        if (!page->uptodate && read_from_disk(file, page) != 0)
+
+        /*
+         * Queue the next window before possibly waiting on this page. Only
+         * the marker of our own window counts; another reader's belongs
+         * to that reader.
+         */
+        if (ra_confirmed_pattern(ra) == RA_SEQUENTIAL && ra->async_size &&
+            page_index == ra->start + ra->size - ra->async_size &&
+            page_test_clear_readahead(file, page))
+            page_cache_async_readahead(file, ra);
+
+        /* Waits for the page if its readahead I/O is in flight */
+        int ret = read_from_disk(file, page);
+        if (ret < 0)
             break;
+        if (ret > 0) {
+            pthread_mutex_lock(&file->lock);
+            file->nr_sync_pages++;
+            pthread_mutex_unlock(&file->lock);
+        }
             
         size_t page_bytes = PAGE_SIZE - page_offset;
         if (page_bytes > bytes_to_read - bytes_read)
@@ -250,10 +648,89 @@ static ssize_t read_file(struct file *file, void *buf, size_t count)
         page_index++;
     }
     
-    file->pos += bytes_read;
     return bytes_read;
 }
 
+static ssize_t read_file(struct file *file, void *buf, size_t count)
+{
+    ssize_t bytes_read = read_file_ra(file, &file->ra, buf, count, file->pos);
+
+    if (bytes_read > 0)
+        file->pos += bytes_read;
+    return bytes_read;
+}
+
+/* Read one page at each of pages[] with a private readahead state */
+static void run_access_pattern(const char *label, const unsigned long *pages, int nr)
+{
+    struct file *file = create_test_file(label, MAX_FILE_SIZE);
+    struct file_ra_state ra;
+    char buffer[PAGE_SIZE];
+    bool data_valid = true;
+
+    if (!file) {
+        printf("Failed to create test file\n");
+        return;
+    }
+    file_ra_state_init(&ra);
+
+    for (int i = 0; i < nr; i++) {
+        unsigned long pos = pages[i] * PAGE_SIZE;
+        ssize_t bytes = read_file_ra(file, &ra, buffer, PAGE_SIZE, pos);
+
+        if (bytes != PAGE_SIZE || (unsigned char)buffer[0] != (pos & 0xFF) ||
+            (unsigned char)buffer[PAGE_SIZE - 1] != ((pos + PAGE_SIZE - 1) & 0xFF))
+            data_valid = false;
+    }
+
+    /* Wait for speculative I/O so the counts are final */
+    wait_for_readahead(file);
+
+    printf("%-10s: detected %-10s reader waited on %2lu of %d pages, "
+           "workers read %2lu\n", label,
+           ra_pattern_names[ra_confirmed_pattern(&ra)],
+           file->nr_sync_pages, nr, file->nr_async_pages);
+    printf("Data verification: %s\n", data_valid ? "PASSED" : "FAILED");
+    free_file(file);
+}
+
+/* Two readers of one file, each with its own readahead state */
+struct reader_args {
+    struct file *file;
+    bool sequential;
+    bool data_valid;
+    enum ra_pattern pattern;
+};
+
+static void *reader_fn(void *arg)
+{
+    struct reader_args *args = arg;
+    unsigned long nr = args->file->size / PAGE_SIZE, seed = 12345;
+    struct file_ra_state ra;
+    char buffer[PAGE_SIZE];
+
+    file_ra_state_init(&ra);
+    args->data_valid = true;
+
+    for (unsigned long i = 0; i < nr / 2; i++) {
+        unsigned long page;
+
+        if (args->sequential) {
+            page = i;
+        } else {
+            seed = seed * 1103515245 + 12345;
+            page = (seed >> 16) % nr;
+        }
+        ssize_t bytes = read_file_ra(args->file, &ra, buffer, PAGE_SIZE,
+                                     page * PAGE_SIZE);
+        if (bytes != PAGE_SIZE ||
+            (unsigned char)buffer[7] != ((page * PAGE_SIZE + 7) & 0xFF))
+            args->data_valid = false;
+    }
+    args->pattern = ra_confirmed_pattern(&ra);
+    return NULL;
+}
+
 int main()
 {
     printf("File Readahead Test Program\n");
@@ -263,6 +740,11 @@ int main()
     printf("Initializing test data...\n");
     for (int i = 0; i < MAX_FILE_SIZE; i++)
         simulated_disk[i] = i & 0xFF;
+
+    if (ra_workers_start() != 0) {
+        printf("Failed to start readahead workers\n");
+        return 1;
+    }
         
     /* Create test file */
     struct file *file = create_test_file("test.dat", MAX_FILE_SIZE);
@@ -287,7 +769,7 @@ int main()
             break;
             
         printf("Read %zd bytes, readahead window: %lu pages\n", 
-               bytes, file->ra_pages);
+               bytes, file->ra.size);
                
         /* Verify data */
         bool data_valid = true;
@@ -311,7 +793,7 @@ int main()
     
     /* Reset file position */
     file->pos = 0;
-    file->ra_pages = MIN_READAHEAD / PAGE_SIZE;
+    file_ra_state_init(&file->ra);
     
     /* Perform some random reads */
     unsigned long positions[] = {
@@ -321,12 +803,14 @@ int main()
         0
     };
     
-    for (int i = 0; positions[i] < MAX_FILE_SIZE; i++) {
+    for (size_t i = 0; i < sizeof(positions) / sizeof(positions[0]); i++) {
         file->pos = positions[i];
         printf("\nSeeking to position %lu\n", file->pos);
         
         ssize_t bytes = read_file(file, buffer, PAGE_SIZE);
-        printf("Read %zd bytes at position %lu\n", bytes, positions[i]);
+        printf("Read %zd bytes at position %lu, pattern %s, window %lu pages\n",
+               bytes, positions[i],
+               ra_pattern_names[ra_confirmed_pattern(&file->ra)], file->ra.size);
         
         /* Verify first few bytes */
         bool data_valid = true;
@@ -339,8 +823,93 @@ int main()
         printf("Data verification: %s\n", data_valid ? "PASSED" : "FAILED");
     }
     
-    /* Cleanup */
     free_file(file);
+
+    /* Test 3: Streaming read overlapping I/O with processing */
+    printf("\nTest 3: Streaming read with async readahead\n");
+    printf("------------------------------------------\n");
+
+    file = create_test_file("stream.dat", MAX_FILE_SIZE);
+    if (!file) {
+        printf("Failed to create test file\n");
+        return 1;
+    }
+
+    struct timespec t0, t1, work = {0, 2000000}; /* 2ms per page */
+    bool stream_valid = true;
+
+    total_read = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {
+        ssize_t bytes = read_file(file, buffer, PAGE_SIZE);
+        if (bytes <= 0)
+            break;
+        if ((unsigned char)buffer[0] != (total_read & 0xFF) ||
+            (unsigned char)buffer[bytes - 1] != ((total_read + bytes - 1) & 0xFF))
+            stream_valid = false;
+        total_read += bytes;
+        nanosleep(&work, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("Read %zu bytes in %ld ms (%lu ms of disk time, %lu ms of processing)\n",
+           total_read,
+           (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000,
+           (unsigned long)PAGE_CACHE_SIZE * 10, (unsigned long)PAGE_CACHE_SIZE * 2);
+    wait_for_readahead(file);
+    printf("Pages read by the reader: %lu, by readahead workers: %lu\n",
+           file->nr_sync_pages, file->nr_async_pages);
+    printf("Data verification: %s\n", stream_valid ? "PASSED" : "FAILED");
+    free_file(file);
+
+    /* Test 4: Access pattern detection with per-reader state */
+    printf("\nTest 4: Access pattern detection\n");
+    printf("--------------------------------\n");
+
+    unsigned long backward[16], strided[12], scattered[12], seed = 42;
+
+    for (int i = 0; i < 16; i++)
+        backward[i] = 55 - i;
+    for (int i = 0; i < 12; i++)
+        strided[i] = 2 + i * 5;
+    for (int i = 0; i < 12; i++) {
+        seed = seed * 1103515245 + 12345;
+        scattered[i] = (seed >> 16) % PAGE_CACHE_SIZE;
+    }
+
+    run_access_pattern("backward", backward, 16);
+    run_access_pattern("strided", strided, 12);
+    run_access_pattern("random", scattered, 12);
+
+    file = create_test_file("shared.dat", MAX_FILE_SIZE);
+    if (!file) {
+        printf("Failed to create test file\n");
+        return 1;
+    }
+
+    struct reader_args readers[2] = {
+        { .file = file, .sequential = true },
+        { .file = file, .sequential = false },
+    };
+    pthread_t reader_threads[2];
+
+    for (int i = 0; i < 2; i++)
+        pthread_create(&reader_threads[i], NULL, reader_fn, &readers[i]);
+    for (int i = 0; i < 2; i++)
+        pthread_join(reader_threads[i], NULL);
+    wait_for_readahead(file);
+
+    for (int i = 0; i < 2; i++)
+        printf("Concurrent %s reader: detected %s, data %s\n",
+               readers[i].sequential ? "sequential" : "random",
+               ra_pattern_names[readers[i].pattern],
+               readers[i].data_valid ? "PASSED" : "FAILED");
+    printf("Pages read by the readers: %lu, by readahead workers: %lu\n",
+           file->nr_sync_pages, file->nr_async_pages);
+    free_file(file);
+
+    /* Cleanup */
+    ra_workers_stop();
     printf("\nTest complete\n");
     
     return 0;